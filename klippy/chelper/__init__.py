@@ -17,11 +17,12 @@ COMPILE_CMD = ("gcc -Wall -g -O2 -shared -fPIC"
 SOURCE_FILES = [
     'pyhelper.c', 'serialqueue.c', 'stepcompress.c', 'itersolve.c',
     'kin_cartesian.c', 'kin_corexy.c', 'kin_delta.c', 'kin_polar.c',
-    'kin_winch.c', 'kin_extruder.c',
+    'kin_winch.c', 'kin_extruder.c', 'moveq.c',
 ]
 DEST_LIB = "c_helper.so"
 OTHER_FILES = [
-    'list.h', 'serialqueue.h', 'stepcompress.h', 'itersolve.h', 'pyhelper.h'
+    'list.h', 'serialqueue.h', 'stepcompress.h', 'itersolve.h', 'pyhelper.h',
+    'moveq.h',
 ]
 
 defs_stepcompress = """
@@ -34,13 +35,18 @@ defs_stepcompress = """
     int stepcompress_set_homing(struct stepcompress *sc, uint64_t homing_clock);
     int stepcompress_queue_msg(struct stepcompress *sc
         , uint32_t *data, int len);
+    int stepcompress_queue_move_msg(struct stepcompress *sc
+        , uint64_t req_clock, uint32_t *data, int len);
 
     struct steppersync *steppersync_alloc(struct serialqueue *sq
         , struct stepcompress **sc_list, int sc_num, int move_num);
     void steppersync_free(struct steppersync *ss);
     void steppersync_set_time(struct steppersync *ss
         , double time_offset, double mcu_freq);
+    void steppersync_set_flush_interval(struct steppersync *ss
+        , uint64_t flush_ticks);
     int steppersync_flush(struct steppersync *ss, uint64_t move_clock);
+    int steppersync_flush_lazy(struct steppersync *ss, uint64_t move_clock);
 """
 
 defs_itersolve = """
@@ -50,11 +56,20 @@ defs_itersolve = """
         , double start_pos_x, double start_pos_y, double start_pos_z
         , double axes_d_x, double axes_d_y, double axes_d_z
         , double start_v, double cruise_v, double accel);
-    int32_t itersolve_gen_steps(struct stepper_kinematics *sk, struct move *m);
-    void itersolve_set_stepcompress(struct stepper_kinematics *sk
+    void itersolve_free(struct stepper_kinematics *sk);
+    int32_t itersolve_queue_move(struct stepper_kinematics *sk
+        , struct move *m);
+    int32_t itersolve_generate_steps(struct stepper_kinematics *sk
+        , double flush_time);
+    int32_t itersolve_set_stepcompress(struct stepper_kinematics *sk
         , struct stepcompress *sc, double step_dist);
+    void itersolve_set_approximation(struct stepper_kinematics *sk
+        , double step_r);
     double itersolve_calc_position_from_coord(struct stepper_kinematics *sk
         , double x, double y, double z);
+    double itersolve_calc_max_rate(struct stepper_kinematics *sk
+        , double start_x, double start_y, double start_z
+        , double end_x, double end_y, double end_z);
     void itersolve_set_commanded_pos(struct stepper_kinematics *sk, double pos);
     double itersolve_get_commanded_pos(struct stepper_kinematics *sk);
 """
@@ -89,6 +104,47 @@ defs_kin_extruder = """
         , double extra_accel_v, double extra_decel_v);
 """
 
+defs_moveq = """
+    #define MOVEQ_MERGE_MAX 32
+    struct moveq {
+        int size, count, leftover, planned_count;
+        double blend_tolerance;
+        double *start_pos, *end_pos, *axes_d;
+        double *is_kinematic_move, *move_d, *accel, *min_move_t;
+        double *max_start_v2, *max_cruise_v2, *delta_v2;
+        double *max_smoothed_v2, *smooth_delta_v2;
+        double *max_kin_start_v2, *max_kin_end_v2;
+        double *accel_t, *cruise_t, *decel_t;
+        double *start_v, *cruise_v, *end_v;
+        double *extrude_r, *extrude_max_corner_v;
+        double *is_blend, *blend_start_r, *blend_end_r;
+        double *plan_start_v2, *plan_smoothed_v2;
+        int merge_pos, merge_count;
+        double merge_points[MOVEQ_MERGE_MAX][3];
+    };
+
+    struct moveq *moveq_alloc(void);
+    void moveq_free(struct moveq *mq);
+    void moveq_reset(struct moveq *mq);
+    void moveq_end_merge(struct moveq *mq);
+    void moveq_set_blend_tolerance(struct moveq *mq, double blend_tolerance);
+    int moveq_prepare(struct moveq *mq, double *start_pos, double *end_pos
+        , double speed, double max_velocity, double max_accel
+        , double max_accel_to_decel);
+    int moveq_add(struct moveq *mq);
+    int moveq_merge(struct moveq *mq, double tolerance);
+    void moveq_limit_speed(struct moveq *mq, int pos
+        , double speed, double accel);
+    void moveq_limit_junction_speed(struct moveq *mq, int pos
+        , double start_speed, double end_speed);
+    int moveq_calc_junction(struct moveq *mq, int pos, double extruder_v2
+        , double junction_deviation);
+    int moveq_plan(struct moveq *mq, int lazy);
+    void moveq_fill(struct moveq *mq, int pos, struct move *m
+        , double print_time);
+    void moveq_pop(struct moveq *mq, int flush_count, int move_count);
+"""
+
 defs_serialqueue = """
     #define MESSAGE_MAX 64
     struct pull_queue_message {
@@ -130,7 +186,7 @@ defs_all = [
     defs_pyhelper, defs_serialqueue, defs_std,
     defs_stepcompress, defs_itersolve,
     defs_kin_cartesian, defs_kin_corexy, defs_kin_delta, defs_kin_polar,
-    defs_kin_winch, defs_kin_extruder
+    defs_kin_winch, defs_kin_extruder, defs_moveq
 ]
 
 # Return the list of file modification times
@@ -4,11 +4,13 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
-#include <math.h> // sqrt
+#include <math.h> // sqrt, remainder
+#include <stddef.h> // offsetof
 #include <stdlib.h> // malloc
 #include <string.h> // memset
 #include "compiler.h" // __visible
 #include "itersolve.h" // struct coord
+#include "list.h" // list_add_tail
 #include "pyhelper.h" // errorf
 #include "stepcompress.h" // queue_append_start
 
@@ -57,6 +59,20 @@ move_fill(struct move *m, double print_time
     m->axes_r.x = axes_d_x * inv_move_d;
     m->axes_r.y = axes_d_y * inv_move_d;
     m->axes_r.z = axes_d_z * inv_move_d;
+    m->is_blend = 0;
+}
+
+// Bend the path of a move filled by move_fill() into a parabola.  The
+// position after traveling a given distance is then
+// start_pos + axes_r*distance + blend_c2*distance^2 - this is used to
+// replace a sharp corner between two moves with a smooth blend.
+void
+move_set_blend(struct move *m, double c2_x, double c2_y, double c2_z)
+{
+    m->is_blend = 1;
+    m->blend_c2.x = c2_x;
+    m->blend_c2.y = c2_y;
+    m->blend_c2.z = c2_z;
 }
 
 // Find the distance travel during acceleration/deceleration
@@ -87,10 +103,185 @@ inline struct coord
 move_get_coord(struct move *m, double move_time)
 {
     double move_dist = move_get_distance(m, move_time);
-    return (struct coord) {
+    struct coord c = {
         .x = m->start_pos.x + m->axes_r.x * move_dist,
         .y = m->start_pos.y + m->axes_r.y * move_dist,
         .z = m->start_pos.z + m->axes_r.z * move_dist };
+    if (unlikely(m->is_blend)) {
+        double move_dist2 = move_dist * move_dist;
+        c.x += m->blend_c2.x * move_dist2;
+        c.y += m->blend_c2.y * move_dist2;
+        c.z += m->blend_c2.z * move_dist2;
+    }
+    return c;
+}
+
+
+/****************************************************************
+ * Position approximation
+ ****************************************************************/
+
+// Some kinematics are expensive to evaluate.  For those, the stepper
+// position during a move may be approximated by a piecewise cubic
+// that is built once per move and then evaluated by the step solver
+// instead of the kinematic callback.  Segments are split until the
+// approximation is within 'approx_step_r' steps of the exact position.
+
+#define APPROX_MIN_STEPS 16
+#define APPROX_MAX_SEGMENTS 1024
+#define APPROX_MIN_SEGMENT_TIME .000010
+#define APPROX_DERIV_TIME .000001
+
+struct approx_segment {
+    double start_time, c0, c1, c2, c3;
+};
+
+struct approx {
+    int count, size, pos;
+    struct approx_segment *segs;
+};
+
+static void
+approx_free(struct approx *a)
+{
+    free(a->segs);
+    memset(a, 0, sizeof(*a));
+}
+
+static inline double
+approx_segment_eval(struct approx_segment *s, double move_time)
+{
+    double t = move_time - s->start_time;
+    return s->c0 + t * (s->c1 + t * (s->c2 + t * s->c3));
+}
+
+// Evaluate the approximation at the given time.  The solver mostly
+// moves forward in time, so start the search from the last segment.
+static inline double
+approx_eval(struct approx *a, double move_time)
+{
+    int pos = a->pos;
+    while (pos + 1 < a->count && move_time >= a->segs[pos + 1].start_time)
+        pos++;
+    while (pos > 0 && move_time < a->segs[pos].start_time)
+        pos--;
+    a->pos = pos;
+    return approx_segment_eval(&a->segs[pos], move_time);
+}
+
+// Calculate the stepper position during step generation
+static inline double
+gen_calc_position(struct stepper_kinematics *sk, struct move *m
+                  , double move_time)
+{
+    if (sk->gen_position)
+        return sk->gen_position(sk, m, move_time);
+    return sk->calc_position(sk, m, move_time);
+}
+
+static double
+approx_calc_velocity(struct stepper_kinematics *sk, struct move *m
+                     , double move_time)
+{
+    double d = APPROX_DERIV_TIME;
+    return ((gen_calc_position(sk, m, move_time + d)
+             - gen_calc_position(sk, m, move_time - d)) / (2. * d));
+}
+
+// Add cubic segments (from the position and velocity at each end)
+// covering the given time range
+static int
+approx_add_range(struct stepper_kinematics *sk, struct move *m
+                 , struct approx *a, double max_error
+                 , double t0, double p0, double v0
+                 , double t1, double p1, double v1)
+{
+    double h = t1 - t0, inv_h = 1. / h, dp = (p1 - p0) * inv_h;
+    struct approx_segment seg = {
+        .start_time = t0, .c0 = p0, .c1 = v0,
+        .c2 = (3. * dp - 2. * v0 - v1) * inv_h,
+        .c3 = (v0 + v1 - 2. * dp) * inv_h * inv_h };
+    int i, fits = 1;
+    for (i=1; i<4; i++) {
+        double t = t0 + h * i * .25;
+        double pos = gen_calc_position(sk, m, t);
+        if (fabs(approx_segment_eval(&seg, t) - pos) > max_error) {
+            fits = 0;
+            break;
+        }
+    }
+    if (fits) {
+        if (a->count >= a->size) {
+            if (a->count >= APPROX_MAX_SEGMENTS)
+                return -1;
+            int size = a->size ? a->size * 2 : 16;
+            struct approx_segment *segs = realloc(a->segs, size*sizeof(*segs));
+            if (!segs)
+                return -1;
+            a->segs = segs;
+            a->size = size;
+        }
+        a->segs[a->count++] = seg;
+        return 0;
+    }
+    if (h < APPROX_MIN_SEGMENT_TIME)
+        // Unable to approximate (likely a kinematic singularity)
+        return -1;
+    double tm = t0 + .5 * h;
+    double pm = gen_calc_position(sk, m, tm);
+    double vm = approx_calc_velocity(sk, m, tm);
+    int ret = approx_add_range(sk, m, a, max_error, t0, p0, v0, tm, pm, vm);
+    if (ret)
+        return ret;
+    return approx_add_range(sk, m, a, max_error, tm, pm, vm, t1, p1, v1);
+}
+
+// Build the approximation of a move.  The acceleration changes at the
+// start and end of the cruise phase, so segments are aligned to those
+// times.  Returns -1 if the move should use the exact callback.
+static int
+approx_build(struct stepper_kinematics *sk, struct move *m, struct approx *a)
+{
+    double times[4] = {
+        0., m->accel_t, m->accel_t + m->cruise_t, m->move_t };
+    double positions[4], est_steps = 0.;
+    int i;
+    for (i=0; i<4; i++)
+        positions[i] = gen_calc_position(sk, m, times[i]);
+    for (i=0; i<3; i++)
+        est_steps += fabs(positions[i+1] - positions[i]);
+    if (est_steps < APPROX_MIN_STEPS * sk->step_dist)
+        // Not worth building an approximation for only a few steps
+        return -1;
+    // Each segment is only checked at a few points, so check against
+    // half the allowed error to keep the error between them in range
+    double max_error = .5 * sk->approx_step_r * sk->step_dist;
+    double t0 = times[0], p0 = positions[0];
+    double v0 = approx_calc_velocity(sk, m, t0);
+    for (i=1; i<4; i++) {
+        double t1 = times[i];
+        if (t1 <= t0)
+            continue;
+        double p1 = positions[i], v1 = approx_calc_velocity(sk, m, t1);
+        if (approx_add_range(sk, m, a, max_error, t0, p0, v0, t1, p1, v1)) {
+            approx_free(a);
+            return -1;
+        }
+        t0 = t1;
+        p0 = p1;
+        v0 = v1;
+    }
+    return 0;
+}
+
+// Calculate the stepper position using the approximation (if available)
+static inline double
+itersolve_calc_position(struct stepper_kinematics *sk, struct move *m
+                        , struct approx *a, double move_time)
+{
+    if (a->count)
+        return approx_eval(a, move_time);
+    return gen_calc_position(sk, m, move_time);
 }
 
 
@@ -105,10 +296,9 @@ struct timepos {
 // Find step using "false position" method
 static struct timepos
 itersolve_find_step(struct stepper_kinematics *sk, struct move *m
-                    , struct timepos low, struct timepos high
-                    , double target)
+                    , struct approx *a, struct timepos low
+                    , struct timepos high, double target)
 {
-    sk_callback calc_position = sk->calc_position;
     struct timepos best_guess = high;
     low.position -= target;
     high.position -= target;
@@ -125,7 +315,7 @@ itersolve_find_step(struct stepper_kinematics *sk, struct move *m
         if (fabs(guess_time - best_guess.time) <= .000000001)
             break;
         best_guess.time = guess_time;
-        best_guess.position = calc_position(sk, m, guess_time);
+        best_guess.position = itersolve_calc_position(sk, m, a, guess_time);
         double guess_position = best_guess.position - target;
         int guess_sign = signbit(guess_position);
         if (guess_sign == high_sign) {
@@ -139,15 +329,16 @@ itersolve_find_step(struct stepper_kinematics *sk, struct move *m
     return best_guess;
 }
 
-// Generate step times for a stepper during a move
-int32_t __visible
-itersolve_gen_steps(struct stepper_kinematics *sk, struct move *m)
+// Generate step times for a stepper between two times in a move
+static int32_t
+itersolve_gen_steps(struct stepper_kinematics *sk, struct move *m
+                    , struct approx *a, double start_time, double end_time)
 {
     struct stepcompress *sc = sk->sc;
-    sk_callback calc_position = sk->calc_position;
     double half_step = .5 * sk->step_dist;
     double mcu_freq = stepcompress_get_mcu_freq(sc);
-    struct timepos last = { 0., sk->commanded_pos }, low = last, high = last;
+    struct timepos last = { start_time, sk->commanded_pos };
+    struct timepos low = last, high = last;
     double seek_time_delta = 0.000100;
     int sdir = stepcompress_get_step_dir(sc);
     struct queue_append qa = queue_append_start(sc, m->print_time, .5);
@@ -156,16 +347,16 @@ itersolve_gen_steps(struct stepper_kinematics *sk, struct move *m)
         double dist = high.position - last.position;
         if (fabs(dist) < half_step) {
         seek_new_high_range:
-            if (high.time >= m->move_t)
-                // At end of move
+            if (high.time >= end_time)
+                // At end of requested range
                 break;
             // Need to increase next step search range
             low = high;
             high.time = last.time + seek_time_delta;
             seek_time_delta += seek_time_delta;
-            if (high.time > m->move_t)
-                high.time = m->move_t;
-            high.position = calc_position(sk, m, high.time);
+            if (high.time > end_time)
+                high.time = end_time;
+            high.position = itersolve_calc_position(sk, m, a, high.time);
             continue;
         }
         int next_sdir = dist > 0.;
@@ -177,7 +368,7 @@ itersolve_gen_steps(struct stepper_kinematics *sk, struct move *m)
             if (last.time >= low.time && high.time > last.time) {
                 // Must seek new low range to avoid re-finding previous time
                 high.time = (last.time + high.time) * .5;
-                high.position = calc_position(sk, m, high.time);
+                high.position = itersolve_calc_position(sk, m, a, high.time);
                 continue;
             }
             int ret = queue_append_set_next_step_dir(&qa, next_sdir);
@@ -187,7 +378,7 @@ itersolve_gen_steps(struct stepper_kinematics *sk, struct move *m)
         }
         // Find step
         double target = last.position + (sdir ? half_step : -half_step);
-        struct timepos next = itersolve_find_step(sk, m, low, high, target);
+        struct timepos next = itersolve_find_step(sk, m, a, low, high, target);
         // Add step at given time
         int ret = queue_append(&qa, next.time * mcu_freq);
         if (ret)
@@ -207,12 +398,162 @@ itersolve_gen_steps(struct stepper_kinematics *sk, struct move *m)
     return 0;
 }
 
+
+
+/****************************************************************
+ * Deferred step generation
+ ****************************************************************/
+
+// Moves are queued on the stepper_kinematics and steps are only
+// generated once the stepcompress code is about to flush that time
+// range to the mcu.  Step generation may run in the steppersync
+// background thread, so the list of pending moves is protected by a
+// lock (the moves themselves are not modified once queued).
+
+struct pending_move {
+    struct list_node node;
+    struct move m;
+    struct approx approx;
+};
+
+// Queue a copy of a move for later step generation
+int32_t __visible
+itersolve_queue_move(struct stepper_kinematics *sk, struct move *m)
+{
+    struct pending_move *pm = malloc(sizeof(*pm));
+    if (!pm) {
+        errorf("itersolve: unable to allocate pending move");
+        return ERROR_RET;
+    }
+    pm->m = *m;
+    memset(&pm->approx, 0, sizeof(pm->approx));
+    pthread_mutex_lock(&sk->pending_lock);
+    list_add_tail(&pm->node, &sk->pending_moves);
+    pthread_mutex_unlock(&sk->pending_lock);
+    return 0;
+}
+
+// Return the oldest queued move (or NULL if none)
+static struct pending_move *
+itersolve_first_pending(struct stepper_kinematics *sk)
+{
+    struct pending_move *pm = NULL;
+    pthread_mutex_lock(&sk->pending_lock);
+    if (!list_empty(&sk->pending_moves))
+        pm = list_first_entry(&sk->pending_moves, struct pending_move, node);
+    pthread_mutex_unlock(&sk->pending_lock);
+    return pm;
+}
+
+// Generate steps for queued moves up to the given print_time (caller
+// must hold the stepcompress lock)
+static int32_t
+itersolve_gen_pending(struct stepper_kinematics *sk, double flush_time)
+{
+    for (;;) {
+        struct pending_move *pm = itersolve_first_pending(sk);
+        if (!pm)
+            break;
+        struct move *m = &pm->m;
+        struct approx *a = &pm->approx;
+        double start_time = sk->gen_move_time;
+        double end_time = flush_time - m->print_time;
+        if (!start_time && end_time > 0. && sk->approx_step_r)
+            // Starting step generation for this move
+            approx_build(sk, m, a);
+        if (end_time < m->move_t) {
+            // Only part of this move is ready for step generation
+            if (end_time <= start_time)
+                break;
+            int32_t ret = itersolve_gen_steps(sk, m, a, start_time, end_time);
+            if (ret)
+                return ret;
+            sk->gen_move_time = end_time;
+            break;
+        }
+        int32_t ret = itersolve_gen_steps(sk, m, a, start_time, m->move_t);
+        if (ret)
+            return ret;
+        sk->gen_move_time = 0.;
+        pthread_mutex_lock(&sk->pending_lock);
+        list_del(&pm->node);
+        pthread_mutex_unlock(&sk->pending_lock);
+        approx_free(a);
+        free(pm);
+    }
+    return 0;
+}
+
+// Generate steps for all queued moves up to the given print_time
+int32_t __visible
+itersolve_generate_steps(struct stepper_kinematics *sk, double flush_time)
+{
+    stepcompress_lock(sk->sc);
+    int32_t ret = itersolve_gen_pending(sk, flush_time);
+    stepcompress_unlock(sk->sc);
+    return ret;
+}
+
+static int32_t
+itersolve_generate_callback(void *data, double flush_time)
+{
+    return itersolve_gen_pending(data, flush_time);
+}
+
+// Initialize the common fields of a newly allocated (and zeroed)
+// stepper_kinematics
+void
+itersolve_init(struct stepper_kinematics *sk)
+{
+    pthread_mutex_init(&sk->pending_lock, NULL);
+    list_init(&sk->pending_moves);
+}
+
+// Free a stepper_kinematics along with any moves still awaiting step
+// generation (the caller must ensure no stepcompress object still
+// uses it for step generation)
 void __visible
+itersolve_free(struct stepper_kinematics *sk)
+{
+    if (!sk)
+        return;
+    while (!list_empty(&sk->pending_moves)) {
+        struct pending_move *pm = list_first_entry(
+            &sk->pending_moves, struct pending_move, node);
+        list_del(&pm->node);
+        approx_free(&pm->approx);
+        free(pm);
+    }
+    pthread_mutex_destroy(&sk->pending_lock);
+    free(sk);
+}
+
+int32_t __visible
 itersolve_set_stepcompress(struct stepper_kinematics *sk
                            , struct stepcompress *sc, double step_dist)
 {
-    sk->sc = sc;
-    sk->step_dist = step_dist;
+    // Steps for already queued moves must be generated with the old
+    // step distance before the new settings take effect
+    stepcompress_lock(sc);
+    int32_t ret = stepcompress_set_generator(
+        sc, itersolve_generate_callback, sk);
+    if (!ret) {
+        sk->sc = sc;
+        sk->step_dist = step_dist;
+    }
+    stepcompress_unlock(sc);
+    return ret;
+}
+
+// Approximate the stepper position during moves with a piecewise
+// cubic that is within 'step_r' steps of the exact position (or use
+// the exact position if 'step_r' is zero)
+void __visible
+itersolve_set_approximation(struct stepper_kinematics *sk, double step_r)
+{
+    stepcompress_lock(sk->sc);
+    sk->approx_step_r = step_r;
+    stepcompress_unlock(sk->sc);
 }
 
 double __visible
@@ -225,14 +566,83 @@ itersolve_calc_position_from_coord(struct stepper_kinematics *sk
     return sk->calc_position(sk, &m, 0.);
 }
 
+#define RATE_SAMPLE_COUNT 8
+#define RATE_REFINE_COUNT 6
+
+// Find the section (of 'count' equal sections between move times 't0'
+// and 't1') with the largest change in stepper position
+static int
+rate_find_max(struct stepper_kinematics *sk, struct move *m
+              , double t0, double t1, int count, double *max_dist)
+{
+    double period = sk->pos_period, last_pos = sk->calc_position(sk, m, t0);
+    int i, max_i = 0;
+    *max_dist = 0.;
+    for (i=0; i<count; i++) {
+        double pos = sk->calc_position(sk, m, t0 + (t1 - t0) * (i+1) / count);
+        double dist = pos - last_pos;
+        if (period)
+            // Position may wrap around (eg, a rotating bed)
+            dist = remainder(dist, period);
+        dist = fabs(dist);
+        if (dist > *max_dist) {
+            *max_dist = dist;
+            max_i = i;
+        }
+        last_pos = pos;
+    }
+    return max_i;
+}
+
+// Return the maximum stepper distance per millimeter of toolhead
+// movement along a line.  The line is checked in sections and the
+// search is then narrowed around the section with the highest rate
+// so that the peak rate of non-linear kinematics is found.
+double __visible
+itersolve_calc_max_rate(struct stepper_kinematics *sk
+                        , double start_x, double start_y, double start_z
+                        , double end_x, double end_y, double end_z)
+{
+    double dx = end_x - start_x, dy = end_y - start_y, dz = end_z - start_z;
+    double move_d = sqrt(dx*dx + dy*dy + dz*dz);
+    if (!move_d)
+        return 0.;
+    struct move m;
+    memset(&m, 0, sizeof(m));
+    move_fill(&m, 0., 0., 1., 0., start_x, start_y, start_z, dx, dy, dz
+              , 0., move_d, 0.);
+    double t0 = 0., t1 = 1., dist, max_rate = 0.;
+    int i;
+    for (i=0; i<RATE_REFINE_COUNT; i++) {
+        double section_t = (t1 - t0) / RATE_SAMPLE_COUNT;
+        int max_i = rate_find_max(sk, &m, t0, t1, RATE_SAMPLE_COUNT, &dist);
+        double rate = dist / section_t;
+        if (rate > max_rate)
+            max_rate = rate;
+        if (!dist)
+            break;
+        // Search the best section and its neighbors
+        double new_t0 = t0 + section_t * (max_i - 1);
+        t1 = t0 + section_t * (max_i + 2);
+        t0 = new_t0 > 0. ? new_t0 : 0.;
+        t1 = t1 < 1. ? t1 : 1.;
+    }
+    return max_rate / move_d;
+}
+
 void __visible
 itersolve_set_commanded_pos(struct stepper_kinematics *sk, double pos)
 {
+    stepcompress_lock(sk->sc);
     sk->commanded_pos = pos;
+    stepcompress_unlock(sk->sc);
 }
 
 double __visible
 itersolve_get_commanded_pos(struct stepper_kinematics *sk)
 {
-    return sk->commanded_pos;
+    stepcompress_lock(sk->sc);
+    double pos = sk->commanded_pos;
+    stepcompress_unlock(sk->sc);
+    return pos;
 }
@@ -1,7 +1,9 @@
 #ifndef ITERSOLVE_H
 #define ITERSOLVE_H
 
+#include <pthread.h> // pthread_mutex_t
 #include <stdint.h> // uint32_t
+#include "list.h" // struct list_head
 
 struct coord {
     double x, y, z;
@@ -18,6 +20,9 @@ struct move {
     double cruise_v;
     struct move_accel accel, decel;
     struct coord start_pos, axes_r;
+    // Corner blends follow a curved path (see move_set_blend())
+    int is_blend;
+    struct coord blend_c2;
 };
 
 struct move *move_alloc(void);
@@ -26,6 +31,7 @@ void move_fill(struct move *m, double print_time
                , double start_pos_x, double start_pos_y, double start_pos_z
                , double axes_d_x, double axes_d_y, double axes_d_z
                , double start_v, double cruise_v, double accel);
+void move_set_blend(struct move *m, double c2_x, double c2_y, double c2_z);
 double move_get_distance(struct move *m, double move_time);
 struct coord move_get_coord(struct move *m, double move_time);
 
@@ -36,13 +42,36 @@ struct stepper_kinematics {
     double step_dist, commanded_pos;
     struct stepcompress *sc;
     sk_callback calc_position;
+    // Optional callback used in place of calc_position during step
+    // generation (only called with the stepcompress lock held)
+    sk_callback gen_position;
+    // Positions that differ by this amount are equivalent (zero if the
+    // stepper position does not wrap around)
+    double pos_period;
+    // Moves awaiting step generation
+    pthread_mutex_t pending_lock; // protects pending_moves list
+    struct list_head pending_moves;
+    double gen_move_time;
+    // Maximum error (in steps) of the optional position approximation
+    double approx_step_r;
 };
 
-int32_t itersolve_gen_steps(struct stepper_kinematics *sk, struct move *m);
-void itersolve_set_stepcompress(struct stepper_kinematics *sk
-                                , struct stepcompress *sc, double step_dist);
+void itersolve_init(struct stepper_kinematics *sk);
+void itersolve_free(struct stepper_kinematics *sk);
+int32_t itersolve_queue_move(struct stepper_kinematics *sk, struct move *m);
+int32_t itersolve_generate_steps(struct stepper_kinematics *sk
+                                 , double flush_time);
+int32_t itersolve_set_stepcompress(struct stepper_kinematics *sk
+                                   , struct stepcompress *sc
+                                   , double step_dist);
+void itersolve_set_approximation(struct stepper_kinematics *sk
+                                 , double step_r);
 double itersolve_calc_position_from_coord(struct stepper_kinematics *sk
                                           , double x, double y, double z);
+double itersolve_calc_max_rate(struct stepper_kinematics *sk
+                               , double start_x, double start_y
+                               , double start_z, double end_x
+                               , double end_y, double end_z);
 void itersolve_set_commanded_pos(struct stepper_kinematics *sk, double pos);
 double itersolve_get_commanded_pos(struct stepper_kinematics *sk);
 
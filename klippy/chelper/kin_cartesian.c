@@ -36,6 +36,7 @@ cartesian_stepper_alloc(char axis)
 {
     struct stepper_kinematics *sk = malloc(sizeof(*sk));
     memset(sk, 0, sizeof(*sk));
+    itersolve_init(sk);
     if (axis == 'x')
         sk->calc_position = cart_stepper_x_calc_position;
     else if (axis == 'y')
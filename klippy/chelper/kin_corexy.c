@@ -30,6 +30,7 @@ corexy_stepper_alloc(char type)
 {
     struct stepper_kinematics *sk = malloc(sizeof(*sk));
     memset(sk, 0, sizeof(*sk));
+    itersolve_init(sk);
     if (type == '+')
         sk->calc_position = corexy_stepper_plus_calc_position;
     else if (type == '-')
@@ -31,6 +31,7 @@ delta_stepper_alloc(double arm2, double tower_x, double tower_y)
 {
     struct delta_stepper *ds = malloc(sizeof(*ds));
     memset(ds, 0, sizeof(*ds));
+    itersolve_init(&ds->sk);
     ds->arm2 = arm2;
     ds->tower_x = tower_x;
     ds->tower_y = tower_y;
@@ -4,7 +4,7 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
-#include <math.h> // sqrt
+#include <math.h> // sqrt, atan2, floor
 #include <stdlib.h> // malloc
 #include <string.h> // memset
 #include "compiler.h" // __visible
@@ -23,19 +23,36 @@ polar_stepper_angle_calc_position(struct stepper_kinematics *sk, struct move *m
                                   , double move_time)
 {
     struct coord c = move_get_coord(m, move_time);
-    // XXX - handle x==y==0
-    // XXX - handle angle wrapping
     return atan2(c.y, c.x);
 }
 
+static double
+polar_stepper_angle_gen_position(struct stepper_kinematics *sk, struct move *m
+                                 , double move_time)
+{
+    struct coord c = move_get_coord(m, move_time);
+    if (!c.x && !c.y)
+        // The angle is undefined at the center - keep the bed still
+        return sk->commanded_pos;
+    // Generate steps to the angle nearest to the last commanded angle
+    // so that the bed does not spin when crossing the negative x axis
+    double angle = atan2(c.y, c.x);
+    double turns = floor((sk->commanded_pos - angle) / (2. * M_PI) + .5);
+    return angle + turns * 2. * M_PI;
+}
+
 struct stepper_kinematics * __visible
 polar_stepper_alloc(char type)
 {
     struct stepper_kinematics *sk = malloc(sizeof(*sk));
     memset(sk, 0, sizeof(*sk));
+    itersolve_init(sk);
     if (type == 'r')
         sk->calc_position = polar_stepper_radius_calc_position;
-    else if (type == 'a')
+    else if (type == 'a') {
         sk->calc_position = polar_stepper_angle_calc_position;
+        sk->gen_position = polar_stepper_angle_gen_position;
+        sk->pos_period = 2. * M_PI;
+    }
     return sk;
 }
@@ -32,6 +32,7 @@ winch_stepper_alloc(double anchor_x, double anchor_y, double anchor_z)
 {
     struct winch_stepper *hs = malloc(sizeof(*hs));
     memset(hs, 0, sizeof(*hs));
+    itersolve_init(&hs->sk);
     hs->anchor.x = anchor_x;
     hs->anchor.y = anchor_y;
     hs->anchor.z = anchor_z;
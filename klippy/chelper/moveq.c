@@ -0,0 +1,724 @@
+// Toolhead look-ahead queue storage and velocity planning
+//
+// Copyright (C) 2016-2019  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <math.h> // sqrt
+#include <stddef.h> // offsetof
+#include <stdlib.h> // malloc
+#include <string.h> // memset
+#include "compiler.h" // __visible
+#include "itersolve.h" // move_fill
+#include "moveq.h" // struct moveq
+#include "pyhelper.h" // errorf
+
+// Common suffixes: _d is distance (in mm), _v is velocity (in
+//   mm/second), _v2 is velocity squared (mm^2/s^2), _t is time (in
+//   seconds), _r is ratio (scalar between 0.0 and 1.0)
+
+#define MOVEQ_INITIAL_SIZE 256
+#define MOVEQ_MERGE_RATIO_TOLERANCE .01
+
+
+/****************************************************************
+ * Queue storage
+ ****************************************************************/
+
+struct moveq_field {
+    size_t offset;
+    int width;
+};
+
+#define MQ_FIELD(name, width) { offsetof(struct moveq, name), (width) }
+
+static const struct moveq_field moveq_fields[] = {
+    MQ_FIELD(start_pos, 4), MQ_FIELD(end_pos, 4), MQ_FIELD(axes_d, 4),
+    MQ_FIELD(is_kinematic_move, 1), MQ_FIELD(move_d, 1), MQ_FIELD(accel, 1),
+    MQ_FIELD(min_move_t, 1), MQ_FIELD(max_start_v2, 1),
+    MQ_FIELD(max_cruise_v2, 1), MQ_FIELD(delta_v2, 1),
+    MQ_FIELD(max_smoothed_v2, 1), MQ_FIELD(smooth_delta_v2, 1),
+    MQ_FIELD(max_kin_start_v2, 1), MQ_FIELD(max_kin_end_v2, 1),
+    MQ_FIELD(accel_t, 1), MQ_FIELD(cruise_t, 1), MQ_FIELD(decel_t, 1),
+    MQ_FIELD(start_v, 1), MQ_FIELD(cruise_v, 1), MQ_FIELD(end_v, 1),
+    MQ_FIELD(extrude_r, 1), MQ_FIELD(extrude_max_corner_v, 1),
+    MQ_FIELD(is_blend, 1), MQ_FIELD(blend_start_r, 3),
+    MQ_FIELD(blend_end_r, 3),
+    MQ_FIELD(plan_start_v2, 1), MQ_FIELD(plan_smoothed_v2, 1),
+};
+
+static inline double **
+moveq_field_ptr(struct moveq *mq, const struct moveq_field *f)
+{
+    return (double **)((char*)mq + f->offset);
+}
+
+// Increase the size of all the per-move arrays
+static int
+moveq_grow(struct moveq *mq, int size)
+{
+    size_t i;
+    for (i=0; i<ARRAY_SIZE(moveq_fields); i++) {
+        const struct moveq_field *f = &moveq_fields[i];
+        double **pdata = moveq_field_ptr(mq, f);
+        double *data = realloc(*pdata, size * f->width * sizeof(*data));
+        if (!data) {
+            errorf("moveq_grow: unable to allocate %d moves", size);
+            return -1;
+        }
+        *pdata = data;
+    }
+    mq->size = size;
+    return 0;
+}
+
+// Allocate a new move queue
+struct moveq * __visible
+moveq_alloc(void)
+{
+    struct moveq *mq = malloc(sizeof(*mq));
+    memset(mq, 0, sizeof(*mq));
+    mq->merge_pos = -1;
+    if (moveq_grow(mq, MOVEQ_INITIAL_SIZE)) {
+        moveq_free(mq);
+        return NULL;
+    }
+    return mq;
+}
+
+// Free memory associated with a move queue
+void __visible
+moveq_free(struct moveq *mq)
+{
+    if (!mq)
+        return;
+    size_t i;
+    for (i=0; i<ARRAY_SIZE(moveq_fields); i++)
+        free(*moveq_field_ptr(mq, &moveq_fields[i]));
+    free(mq);
+}
+
+// Copy all the data of a move to another queue position
+static void
+moveq_copy(struct moveq *mq, int dest, int src)
+{
+    size_t i;
+    for (i=0; i<ARRAY_SIZE(moveq_fields); i++) {
+        const struct moveq_field *f = &moveq_fields[i];
+        double *data = *moveq_field_ptr(mq, f);
+        memcpy(&data[dest * f->width], &data[src * f->width]
+               , f->width * sizeof(*data));
+    }
+}
+
+// Discard all queued moves
+void __visible
+moveq_reset(struct moveq *mq)
+{
+    mq->count = mq->leftover = mq->planned_count = 0;
+    mq->merge_pos = -1;
+}
+
+// Don't merge the next queued move into the moves already queued
+void __visible
+moveq_end_merge(struct moveq *mq)
+{
+    mq->merge_pos = -1;
+}
+
+// Set the maximum distance a corner blend may deviate from the corner
+void __visible
+moveq_set_blend_tolerance(struct moveq *mq, double blend_tolerance)
+{
+    mq->blend_tolerance = blend_tolerance;
+}
+
+// Remove the first 'move_count' moves from the queue
+void __visible
+moveq_pop(struct moveq *mq, int flush_count, int move_count)
+{
+    mq->leftover = flush_count - move_count;
+    if (!move_count)
+        return;
+    int remaining = mq->count - move_count;
+    size_t i;
+    for (i=0; i<ARRAY_SIZE(moveq_fields); i++) {
+        const struct moveq_field *f = &moveq_fields[i];
+        double *data = *moveq_field_ptr(mq, f);
+        memmove(data, &data[move_count * f->width]
+                , remaining * f->width * sizeof(*data));
+    }
+    mq->count -= move_count;
+    mq->planned_count -= move_count;
+    // Don't extend a move that may have already been inspected
+    mq->merge_pos = -1;
+}
+
+
+/****************************************************************
+ * Move setup
+ ****************************************************************/
+
+// Fill the slot after the last queued move with a new move request.
+// The move is not part of the queue until moveq_add() is called.
+int __visible
+moveq_prepare(struct moveq *mq, double *start_pos, double *end_pos
+              , double speed, double max_velocity, double max_accel
+              , double max_accel_to_decel)
+{
+    int pos = mq->count;
+    if (pos + 1 >= mq->size && moveq_grow(mq, mq->size * 2))
+        return -1;
+    double *sp = &mq->start_pos[pos*4], *ep = &mq->end_pos[pos*4];
+    double *axes_d = &mq->axes_d[pos*4];
+    int i;
+    for (i=0; i<4; i++) {
+        sp[i] = start_pos[i];
+        ep[i] = end_pos[i];
+        axes_d[i] = end_pos[i] - start_pos[i];
+    }
+    double accel = max_accel;
+    double velocity = speed < max_velocity ? speed : max_velocity;
+    double move_d = sqrt(axes_d[0]*axes_d[0] + axes_d[1]*axes_d[1]
+                         + axes_d[2]*axes_d[2]);
+    mq->is_kinematic_move[pos] = 1.;
+    if (move_d < .000000001) {
+        // Extrude only move
+        for (i=0; i<3; i++) {
+            ep[i] = sp[i];
+            axes_d[i] = 0.;
+        }
+        move_d = fabs(axes_d[3]);
+        accel = 99999999.9;
+        velocity = speed;
+        mq->is_kinematic_move[pos] = 0.;
+    }
+    mq->move_d[pos] = move_d;
+    mq->accel[pos] = accel;
+    mq->min_move_t[pos] = move_d / velocity;
+    // Junction speeds are tracked in velocity squared.  The
+    // delta_v2 is the maximum amount of this squared-velocity that
+    // can change in this move.
+    mq->max_start_v2[pos] = 0.;
+    mq->max_cruise_v2[pos] = velocity * velocity;
+    mq->delta_v2[pos] = 2. * move_d * accel;
+    mq->max_smoothed_v2[pos] = 0.;
+    mq->smooth_delta_v2[pos] = 2. * move_d * max_accel_to_decel;
+    mq->max_kin_start_v2[pos] = mq->max_kin_end_v2[pos] = velocity * velocity;
+    mq->accel_t[pos] = mq->cruise_t[pos] = mq->decel_t[pos] = 0.;
+    mq->start_v[pos] = mq->cruise_v[pos] = mq->end_v[pos] = 0.;
+    mq->extrude_r[pos] = mq->extrude_max_corner_v[pos] = 0.;
+    mq->is_blend[pos] = 0.;
+    return pos;
+}
+
+// Append the prepared move to the queue
+int __visible
+moveq_add(struct moveq *mq)
+{
+    mq->merge_pos = mq->count;
+    mq->merge_count = 0;
+    return mq->count++;
+}
+
+// Check if two values are equal within a small relative tolerance
+static int
+moveq_is_close(double a, double b)
+{
+    double max_ab = fmax(fabs(a), fabs(b));
+    return fabs(a - b) <= MOVEQ_MERGE_RATIO_TOLERANCE * max_ab;
+}
+
+// Distance from a point to the line through 'start' with direction 'dir'
+static double
+moveq_line_distance(double *start, double *dir, double dir_len, double *point)
+{
+    double dx = point[0] - start[0], dy = point[1] - start[1];
+    double dz = point[2] - start[2];
+    double cx = dy * dir[2] - dz * dir[1], cy = dz * dir[0] - dx * dir[2];
+    double cz = dx * dir[1] - dy * dir[0];
+    return sqrt(cx*cx + cy*cy + cz*cz) / dir_len;
+}
+
+// Attempt to merge the prepared move into the last queued move.  The
+// moves are only merged if they are nearly collinear (all points
+// joining the merged segments are within 'tolerance' of the combined
+// move), share the same velocity limits, and extrude at the same
+// ratio.  Returns 1 if the moves were merged.
+int __visible
+moveq_merge(struct moveq *mq, double tolerance)
+{
+    int pos = mq->count, prev = pos - 1;
+    if (prev < mq->leftover || prev != mq->merge_pos
+        || mq->merge_count >= MOVEQ_MERGE_MAX
+        || !mq->is_kinematic_move[pos] || !mq->is_kinematic_move[prev]
+        || mq->accel[pos] != mq->accel[prev]
+        || mq->max_cruise_v2[pos] != mq->max_cruise_v2[prev]
+        || mq->max_kin_end_v2[prev] < mq->max_cruise_v2[prev]
+        || mq->max_kin_start_v2[pos] < mq->max_cruise_v2[pos])
+        return 0;
+    double move_d = mq->move_d[pos], prev_move_d = mq->move_d[prev];
+    double *axes_d = &mq->axes_d[pos*4], *prev_axes_d = &mq->axes_d[prev*4];
+    if (!moveq_is_close(mq->smooth_delta_v2[pos] / move_d
+                        , mq->smooth_delta_v2[prev] / prev_move_d)
+        || !moveq_is_close(axes_d[3] / move_d, prev_axes_d[3] / prev_move_d))
+        return 0;
+    if (axes_d[0]*prev_axes_d[0] + axes_d[1]*prev_axes_d[1]
+        + axes_d[2]*prev_axes_d[2] <= 0.)
+        return 0;
+    // Check that the combined move stays within the tolerance
+    double *start_pos = &mq->start_pos[prev*4];
+    double merged_d[4], merged_move_d2 = 0.;
+    int i;
+    for (i=0; i<4; i++)
+        merged_d[i] = prev_axes_d[i] + axes_d[i];
+    for (i=0; i<3; i++)
+        merged_move_d2 += merged_d[i] * merged_d[i];
+    double merged_move_d = sqrt(merged_move_d2);
+    memcpy(mq->merge_points[mq->merge_count], &mq->end_pos[prev*4]
+           , sizeof(mq->merge_points[0]));
+    for (i=0; i<=mq->merge_count; i++) {
+        double dist = moveq_line_distance(start_pos, merged_d, merged_move_d
+                                          , mq->merge_points[i]);
+        if (dist > tolerance)
+            return 0;
+    }
+    mq->merge_count++;
+    // Replace the last queued move with the combined move
+    double ratio = merged_move_d / prev_move_d;
+    memcpy(&mq->end_pos[prev*4], &mq->end_pos[pos*4], sizeof(merged_d));
+    memcpy(prev_axes_d, merged_d, sizeof(merged_d));
+    mq->move_d[prev] = merged_move_d;
+    mq->min_move_t[prev] = merged_move_d / sqrt(mq->max_cruise_v2[prev]);
+    mq->delta_v2[prev] *= ratio;
+    mq->smooth_delta_v2[prev] *= ratio;
+    mq->extrude_r[prev] = merged_d[3] / merged_move_d;
+    mq->max_kin_end_v2[prev] = mq->max_kin_end_v2[pos];
+    if (mq->planned_count > prev)
+        mq->planned_count = prev;
+    return 1;
+}
+
+// Reduce the maximum velocity and acceleration of a move
+void __visible
+moveq_limit_speed(struct moveq *mq, int pos, double speed, double accel)
+{
+    double speed2 = speed * speed;
+    if (speed2 < mq->max_cruise_v2[pos]) {
+        mq->max_cruise_v2[pos] = speed2;
+        mq->min_move_t[pos] = mq->move_d[pos] / speed;
+    }
+    if (accel < mq->accel[pos])
+        mq->accel[pos] = accel;
+    double delta_v2 = 2. * mq->move_d[pos] * mq->accel[pos];
+    mq->delta_v2[pos] = delta_v2;
+    if (delta_v2 < mq->smooth_delta_v2[pos])
+        mq->smooth_delta_v2[pos] = delta_v2;
+}
+
+static inline double
+min2(double a, double b)
+{
+    return a < b ? a : b;
+}
+
+// Limit the velocity at the start and end of a move
+void __visible
+moveq_limit_junction_speed(struct moveq *mq, int pos, double start_speed
+                           , double end_speed)
+{
+    mq->max_kin_start_v2[pos] = min2(mq->max_kin_start_v2[pos]
+                                     , start_speed * start_speed);
+    mq->max_kin_end_v2[pos] = min2(mq->max_kin_end_v2[pos]
+                                   , end_speed * end_speed);
+}
+
+// Shorten a move by removing distance from its start and end
+static void
+moveq_trim(struct moveq *mq, int pos, double start_trim_d, double end_trim_d)
+{
+    double move_d = mq->move_d[pos];
+    double new_move_d = move_d - start_trim_d - end_trim_d;
+    double *sp = &mq->start_pos[pos*4], *ep = &mq->end_pos[pos*4];
+    double *axes_d = &mq->axes_d[pos*4];
+    int i;
+    for (i=0; i<4; i++) {
+        double axis_r = axes_d[i] / move_d;
+        sp[i] += axis_r * start_trim_d;
+        ep[i] -= axis_r * end_trim_d;
+        axes_d[i] = axis_r * new_move_d;
+    }
+    double ratio = new_move_d / move_d;
+    mq->move_d[pos] = new_move_d;
+    mq->min_move_t[pos] *= ratio;
+    mq->delta_v2[pos] *= ratio;
+    mq->smooth_delta_v2[pos] *= ratio;
+}
+
+// Estimate the time to travel 'dist' when starting at sqrt(start_v2)
+// and accelerating up to sqrt(max_v2)
+static double
+moveq_est_time(double start_v2, double max_v2, double accel, double dist)
+{
+    double start_v = sqrt(start_v2), max_v = sqrt(max_v2);
+    double accel_d = (max_v2 - start_v2) / (2. * accel);
+    if (accel_d >= dist)
+        return (sqrt(start_v2 + 2. * accel * dist) - start_v) / accel;
+    return (max_v - start_v) / accel + (dist - accel_d) / max_v;
+}
+
+// Attempt to replace the corner between a move and the move queued
+// before it with a parabolic blend.  The blend starts 'blend_d' before
+// the corner and ends 'blend_d' after it.  Its direction changes
+// linearly with distance from start_r to end_r, so the path deviates
+// from the corner by blend_d*|end_r-start_r|/4 and the centripetal
+// acceleration at velocity v is v^2*|end_r-start_r|/(2*blend_d).  The
+// centripetal and tangential acceleration are each limited to
+// accel/sqrt(2) so that their combined magnitude does not exceed accel.
+// Returns 1 if a blend was inserted (the move is then located at
+// 'pos + 1').
+#define MOVEQ_BLEND_TRIES 3
+
+static int
+moveq_blend(struct moveq *mq, int pos, double junction_v2
+            , double extruder_v2)
+{
+    int prev = pos - 1;
+    double move_d = mq->move_d[pos], prev_move_d = mq->move_d[prev];
+    double *axes_d = &mq->axes_d[pos*4], *prev_axes_d = &mq->axes_d[prev*4];
+    double start_r[3], end_r[3], diff_r2 = 0.;
+    int i;
+    for (i=0; i<3; i++) {
+        start_r[i] = prev_axes_d[i] / prev_move_d;
+        end_r[i] = axes_d[i] / move_d;
+        diff_r2 += (end_r[i] - start_r[i]) * (end_r[i] - start_r[i]);
+    }
+    double diff_r = sqrt(diff_r2);
+    double accel = min2(mq->accel[pos], mq->accel[prev]);
+    double blend_accel = accel * M_SQRT1_2;
+    double max_v2 = min2(mq->max_cruise_v2[pos], mq->max_cruise_v2[prev]);
+    double max_blend_d = 4. * mq->blend_tolerance / diff_r;
+    max_blend_d = min2(max_blend_d, .5 * move_d);
+    max_blend_d = min2(max_blend_d, .5 * prev_move_d);
+    // Estimate the time spent near the corner (the second half of the
+    // previous move and first half of the new move) with and without a
+    // blend.  A shorter blend has a lower maximum speed, so try a few
+    // blend lengths and use the fastest.
+    double prev_side_d = .5 * prev_move_d, side_d = .5 * move_d;
+    double best_t = (moveq_est_time(junction_v2, max_v2, accel, prev_side_d)
+                     + moveq_est_time(junction_v2, max_v2, accel, side_d));
+    double blend_d = 0., blend_v2 = 0.;
+    for (i=0; i<MOVEQ_BLEND_TRIES; i++) {
+        double try_d = max_blend_d / (1 << (2*i));
+        double try_v2 = 2. * try_d * blend_accel / diff_r;
+        try_v2 = min2(try_v2, extruder_v2);
+        try_v2 = min2(try_v2, max_v2);
+        try_v2 = min2(try_v2, mq->max_kin_end_v2[prev]);
+        try_v2 = min2(try_v2, mq->max_kin_start_v2[pos]);
+        try_v2 = min2(try_v2, (mq->max_start_v2[prev]
+                               + 2. * (prev_move_d - try_d) * accel));
+        if (try_v2 <= junction_v2)
+            break;
+        double try_t = (2. * try_d / sqrt(try_v2)
+                        + moveq_est_time(try_v2, max_v2, accel
+                                         , prev_side_d - try_d)
+                        + moveq_est_time(try_v2, max_v2, accel
+                                         , side_d - try_d));
+        if (try_t < best_t) {
+            best_t = try_t;
+            blend_d = try_d;
+            blend_v2 = try_v2;
+        }
+    }
+    if (!blend_d)
+        // Regular cornering is estimated to be at least as fast
+        return 0;
+
+    // Move the new move after the blend and shorten the adjacent moves
+    int next = pos + 1;
+    moveq_copy(mq, next, pos);
+    moveq_trim(mq, prev, 0., blend_d);
+    moveq_trim(mq, next, blend_d, 0.);
+    // Setup blend
+    double *sp = &mq->start_pos[pos*4], *ep = &mq->end_pos[pos*4];
+    double *blend_axes_d = &mq->axes_d[pos*4];
+    for (i=0; i<4; i++) {
+        sp[i] = mq->end_pos[prev*4 + i];
+        ep[i] = mq->start_pos[next*4 + i];
+        blend_axes_d[i] = ep[i] - sp[i];
+    }
+    memcpy(&mq->blend_start_r[pos*3], start_r, sizeof(start_r));
+    memcpy(&mq->blend_end_r[pos*3], end_r, sizeof(end_r));
+    double blend_move_d = 2. * blend_d;
+    double smooth_r = M_SQRT1_2 * min2(
+        mq->smooth_delta_v2[prev] / mq->move_d[prev]
+        , mq->smooth_delta_v2[next] / mq->move_d[next]);
+    mq->is_blend[pos] = 1.;
+    mq->is_kinematic_move[pos] = 1.;
+    mq->move_d[pos] = blend_move_d;
+    mq->accel[pos] = blend_accel;
+    mq->min_move_t[pos] = blend_move_d / sqrt(blend_v2);
+    mq->max_start_v2[pos] = min2(
+        blend_v2, mq->max_start_v2[prev] + mq->delta_v2[prev]);
+    mq->max_cruise_v2[pos] = blend_v2;
+    mq->max_kin_start_v2[pos] = mq->max_kin_end_v2[pos] = blend_v2;
+    mq->delta_v2[pos] = 2. * blend_move_d * blend_accel;
+    mq->max_smoothed_v2[pos] = min2(
+        mq->max_start_v2[pos]
+        , mq->max_smoothed_v2[prev] + mq->smooth_delta_v2[prev]);
+    mq->smooth_delta_v2[pos] = smooth_r * blend_move_d;
+    mq->extrude_r[pos] = blend_axes_d[3] / blend_move_d;
+    mq->extrude_max_corner_v[pos] = 0.;
+    // The new move starts at the end of the blend
+    mq->max_start_v2[next] = blend_v2;
+    mq->max_smoothed_v2[next] = min2(
+        blend_v2, mq->max_smoothed_v2[pos] + mq->smooth_delta_v2[pos]);
+    mq->count++;
+    if (mq->merge_pos == pos)
+        mq->merge_pos = next;
+    if (mq->planned_count > prev)
+        mq->planned_count = prev;
+    return 1;
+}
+
+// Calculate the maximum junction speed between a kinematic move and
+// the kinematic move queued before it.  Returns the queue position of
+// the move (which changes if a corner blend is inserted before it).
+int __visible
+moveq_calc_junction(struct moveq *mq, int pos, double extruder_v2
+                    , double junction_deviation)
+{
+    int prev = pos - 1;
+    double *axes_d = &mq->axes_d[pos*4], *prev_axes_d = &mq->axes_d[prev*4];
+    double move_d = mq->move_d[pos], prev_move_d = mq->move_d[prev];
+    double accel = mq->accel[pos], prev_accel = mq->accel[prev];
+    // Find max velocity using "approximated centripetal velocity"
+    double junction_cos_theta = -((axes_d[0] * prev_axes_d[0]
+                                   + axes_d[1] * prev_axes_d[1]
+                                   + axes_d[2] * prev_axes_d[2])
+                                  / (move_d * prev_move_d));
+    if (junction_cos_theta > 0.999999)
+        return pos;
+    if (junction_cos_theta < -0.999999)
+        junction_cos_theta = -0.999999;
+    double sin_theta_d2 = sqrt(0.5*(1.0-junction_cos_theta));
+    double R = junction_deviation * sin_theta_d2 / (1. - sin_theta_d2);
+    double tan_theta_d2 = sin_theta_d2 / sqrt(0.5*(1.0+junction_cos_theta));
+    double move_centripetal_v2 = .5 * move_d * tan_theta_d2 * accel;
+    double prev_move_centripetal_v2 = .5 * prev_move_d * tan_theta_d2
+                                      * prev_accel;
+    double max_start_v2 = min2(R * accel, R * prev_accel);
+    max_start_v2 = min2(max_start_v2, move_centripetal_v2);
+    max_start_v2 = min2(max_start_v2, prev_move_centripetal_v2);
+    max_start_v2 = min2(max_start_v2, extruder_v2);
+    max_start_v2 = min2(max_start_v2, mq->max_cruise_v2[pos]);
+    max_start_v2 = min2(max_start_v2, mq->max_cruise_v2[prev]);
+    max_start_v2 = min2(max_start_v2, mq->max_kin_start_v2[pos]);
+    max_start_v2 = min2(max_start_v2, mq->max_kin_end_v2[prev]);
+    max_start_v2 = min2(max_start_v2, (mq->max_start_v2[prev]
+                                       + mq->delta_v2[prev]));
+    if (mq->blend_tolerance > 0. && prev >= mq->leftover
+        && moveq_blend(mq, pos, max_start_v2, extruder_v2))
+        return pos + 1;
+    mq->max_start_v2[pos] = max_start_v2;
+    mq->max_smoothed_v2[pos] = min2(
+        max_start_v2, mq->max_smoothed_v2[prev] + mq->smooth_delta_v2[prev]);
+    return pos;
+}
+
+
+/****************************************************************
+ * Look-ahead planning
+ ****************************************************************/
+
+// Determine the accel, cruise, and decel portions of a move
+static void
+moveq_set_junction(struct moveq *mq, int pos, double start_v2
+                   , double cruise_v2, double end_v2)
+{
+    // Determine accel, cruise, and decel portions of the move distance
+    double move_d = mq->move_d[pos];
+    double inv_delta_v2 = 1. / mq->delta_v2[pos];
+    double accel_r = (cruise_v2 - start_v2) * inv_delta_v2;
+    double decel_r = (cruise_v2 - end_v2) * inv_delta_v2;
+    double cruise_r = 1. - accel_r - decel_r;
+    // Determine move velocities
+    double start_v = mq->start_v[pos] = sqrt(start_v2);
+    double cruise_v = mq->cruise_v[pos] = sqrt(cruise_v2);
+    double end_v = mq->end_v[pos] = sqrt(end_v2);
+    // Determine time spent in each portion of move (time is the
+    // distance divided by average velocity)
+    mq->accel_t[pos] = accel_r * move_d / ((start_v + cruise_v) * 0.5);
+    mq->cruise_t[pos] = cruise_r * move_d / cruise_v;
+    mq->decel_t[pos] = decel_r * move_d / ((end_v + cruise_v) * 0.5);
+}
+
+// Update the maximum start velocity of each move assuming the
+// toolhead comes to a complete stop after the last queued move.
+// Appending a move can only raise these limits, and once a move's
+// limits are unchanged the limits of all earlier moves are also
+// unchanged, so only the affected suffix of the queue is visited.
+static void
+moveq_update_limits(struct moveq *mq)
+{
+    int planned_count = mq->planned_count, i;
+    double next_end_v2 = 0., next_smoothed_v2 = 0.;
+    for (i=mq->count-1; i>=mq->leftover; i--) {
+        double start_v2 = min2(mq->max_start_v2[i]
+                               , next_end_v2 + mq->delta_v2[i]);
+        double smoothed_v2 = min2(mq->max_smoothed_v2[i]
+                                  , next_smoothed_v2 + mq->smooth_delta_v2[i]);
+        if (i < planned_count && start_v2 == mq->plan_start_v2[i]
+            && smoothed_v2 == mq->plan_smoothed_v2[i])
+            break;
+        mq->plan_start_v2[i] = next_end_v2 = start_v2;
+        mq->plan_smoothed_v2[i] = next_smoothed_v2 = smoothed_v2;
+    }
+    mq->planned_count = mq->count;
+}
+
+static inline double
+moveq_next_end_v2(struct moveq *mq, int pos)
+{
+    return pos + 1 < mq->count ? mq->plan_start_v2[pos + 1] : 0.;
+}
+
+static inline double
+moveq_next_smoothed_v2(struct moveq *mq, int pos)
+{
+    return pos + 1 < mq->count ? mq->plan_smoothed_v2[pos + 1] : 0.;
+}
+
+// Check if a move can not accelerate (its timing depends on the
+// cruise velocity of an earlier move)
+static int
+moveq_is_delayed(struct moveq *mq, int pos)
+{
+    if (pos >= mq->count)
+        return 0;
+    double reachable_smoothed_v2 = (moveq_next_smoothed_v2(mq, pos)
+                                    + mq->smooth_delta_v2[pos]);
+    return mq->plan_smoothed_v2[pos] >= reachable_smoothed_v2;
+}
+
+// Check if a move determines the peak cruise velocity of itself and
+// any moves queued after it
+static int
+moveq_is_peak(struct moveq *mq, int pos)
+{
+    double next_smoothed_v2 = moveq_next_smoothed_v2(mq, pos);
+    double smoothed_v2 = mq->plan_smoothed_v2[pos];
+    double smooth_delta_v2 = mq->smooth_delta_v2[pos];
+    if (smoothed_v2 >= next_smoothed_v2 + smooth_delta_v2)
+        return 0;
+    return (smoothed_v2 + smooth_delta_v2 > next_smoothed_v2
+            || moveq_is_delayed(mq, pos + 1));
+}
+
+// Calculate the velocity trapezoid of queued moves.  Returns the
+// number of moves that may be flushed, or -1 if a lazy flush found
+// nothing to flush.
+int __visible
+moveq_plan(struct moveq *mq, int lazy)
+{
+    moveq_update_limits(mq);
+    int count = mq->count, flush_count = count, i = count - 1, j;
+    // Moves that are "delayed" always form a contiguous range ending
+    // at 'delayed_last'.
+    int delayed_count = 0, delayed_last = 0;
+    if (lazy) {
+        // The velocity of moves up to the second to last peak is
+        // final - moves after it may still change
+        int peaks = 0;
+        for (; i>=mq->leftover; i--)
+            if (moveq_is_peak(mq, i) && peaks++)
+                break;
+        if (i < mq->leftover)
+            return -1;
+        flush_count = i;
+        if (moveq_is_delayed(mq, i + 1)) {
+            delayed_count = 1;
+            delayed_last = i + 1;
+        }
+    }
+    // Traverse queue from last to first move and determine maximum
+    // junction speed assuming the robot comes to a complete stop
+    // after the last move.
+    double next_end_v2 = moveq_next_end_v2(mq, i);
+    double next_smoothed_v2 = moveq_next_smoothed_v2(mq, i);
+    double peak_cruise_v2 = 0.;
+    for (; i>=mq->leftover; i--) {
+        double delta_v2 = mq->delta_v2[i];
+        double smooth_delta_v2 = mq->smooth_delta_v2[i];
+        double max_cruise_v2 = mq->max_cruise_v2[i];
+        double reachable_start_v2 = next_end_v2 + delta_v2;
+        double start_v2 = mq->plan_start_v2[i];
+        double reachable_smoothed_v2 = next_smoothed_v2 + smooth_delta_v2;
+        double smoothed_v2 = mq->plan_smoothed_v2[i];
+        if (smoothed_v2 < reachable_smoothed_v2) {
+            // It's possible for this move to accelerate
+            if (smoothed_v2 + smooth_delta_v2 > next_smoothed_v2
+                || delayed_count) {
+                // This move can decelerate or this is a full accel
+                // move after a full decel move
+                peak_cruise_v2 = min2(max_cruise_v2, (
+                    smoothed_v2 + reachable_smoothed_v2) * .5);
+                if (delayed_count) {
+                    // Propagate peak_cruise_v2 to any delayed moves
+                    if (i < flush_count) {
+                        for (j=delayed_last; j>delayed_last-delayed_count
+                                 ; j--) {
+                            double ms_v2 = mq->plan_start_v2[j];
+                            double me_v2 = moveq_next_end_v2(mq, j);
+                            double mc_v2 = min2(peak_cruise_v2, ms_v2);
+                            moveq_set_junction(mq, j, min2(ms_v2, mc_v2)
+                                               , mc_v2, min2(me_v2, mc_v2));
+                        }
+                    }
+                    delayed_count = 0;
+                }
+            }
+            if (i < flush_count) {
+                double cruise_v2 = min2((start_v2 + reachable_start_v2) * .5
+                                        , max_cruise_v2);
+                cruise_v2 = min2(cruise_v2, peak_cruise_v2);
+                moveq_set_junction(mq, i, min2(start_v2, cruise_v2)
+                                   , cruise_v2, min2(next_end_v2, cruise_v2));
+            }
+        } else {
+            // Delay calculating this move until peak_cruise_v2 is known
+            if (!delayed_count)
+                delayed_last = i;
+            delayed_count++;
+        }
+        next_end_v2 = start_v2;
+        next_smoothed_v2 = smoothed_v2;
+    }
+    return flush_count;
+}
+
+// Populate a 'struct move' with the velocity trapezoid of a queued move
+void __visible
+moveq_fill(struct moveq *mq, int pos, struct move *m, double print_time)
+{
+    double *sp = &mq->start_pos[pos*4], *axes_d = &mq->axes_d[pos*4];
+    if (mq->is_blend[pos]) {
+        // Travel along start_r while bending the path so that it ends
+        // heading along end_r
+        double *start_r = &mq->blend_start_r[pos*3];
+        double *end_r = &mq->blend_end_r[pos*3];
+        move_fill(m, print_time, mq->accel_t[pos], mq->cruise_t[pos]
+                  , mq->decel_t[pos], sp[0], sp[1], sp[2]
+                  , start_r[0], start_r[1], start_r[2]
+                  , mq->start_v[pos], mq->cruise_v[pos], mq->accel[pos]);
+        double c2 = .5 / mq->move_d[pos];
+        move_set_blend(m, c2 * (end_r[0] - start_r[0])
+                       , c2 * (end_r[1] - start_r[1])
+                       , c2 * (end_r[2] - start_r[2]));
+        return;
+    }
+    move_fill(m, print_time, mq->accel_t[pos], mq->cruise_t[pos]
+              , mq->decel_t[pos], sp[0], sp[1], sp[2]
+              , axes_d[0], axes_d[1], axes_d[2]
+              , mq->start_v[pos], mq->cruise_v[pos], mq->accel[pos]);
+}
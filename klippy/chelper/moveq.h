@@ -0,0 +1,55 @@
+#ifndef MOVEQ_H
+#define MOVEQ_H
+
+struct move;
+
+#define MOVEQ_MERGE_MAX 32
+
+// Storage for the toolhead look-ahead queue.  Moves are kept in
+// parallel arrays (indexed by queue position) to avoid allocating an
+// object for every move.
+struct moveq {
+    int size, count, leftover, planned_count;
+    double blend_tolerance;
+    // Positions and distances (four entries per move: x, y, z, e)
+    double *start_pos, *end_pos, *axes_d;
+    // Velocity limits
+    double *is_kinematic_move, *move_d, *accel, *min_move_t;
+    double *max_start_v2, *max_cruise_v2, *delta_v2;
+    double *max_smoothed_v2, *smooth_delta_v2;
+    // Junction velocity limits requested by the kinematics
+    double *max_kin_start_v2, *max_kin_end_v2;
+    // Final velocity trapezoid
+    double *accel_t, *cruise_t, *decel_t;
+    double *start_v, *cruise_v, *end_v;
+    // Extruder state
+    double *extrude_r, *extrude_max_corner_v;
+    // Corner blend path (unit vectors of the incoming/outgoing moves)
+    double *is_blend, *blend_start_r, *blend_end_r;
+    // Velocity limits calculated by moveq_plan()
+    double *plan_start_v2, *plan_smoothed_v2;
+    // Points joining the segments merged into the move at merge_pos
+    int merge_pos, merge_count;
+    double merge_points[MOVEQ_MERGE_MAX][3];
+};
+
+struct moveq *moveq_alloc(void);
+void moveq_free(struct moveq *mq);
+void moveq_reset(struct moveq *mq);
+void moveq_end_merge(struct moveq *mq);
+void moveq_set_blend_tolerance(struct moveq *mq, double blend_tolerance);
+int moveq_prepare(struct moveq *mq, double *start_pos, double *end_pos
+                  , double speed, double max_velocity, double max_accel
+                  , double max_accel_to_decel);
+int moveq_add(struct moveq *mq);
+int moveq_merge(struct moveq *mq, double tolerance);
+void moveq_limit_speed(struct moveq *mq, int pos, double speed, double accel);
+void moveq_limit_junction_speed(struct moveq *mq, int pos, double start_speed
+                                , double end_speed);
+int moveq_calc_junction(struct moveq *mq, int pos, double extruder_v2
+                        , double junction_deviation);
+int moveq_plan(struct moveq *mq, int lazy);
+void moveq_fill(struct moveq *mq, int pos, struct move *m, double print_time);
+void moveq_pop(struct moveq *mq, int flush_count, int move_count);
+
+#endif // moveq.h
@@ -14,6 +14,8 @@
 // This code is written in C (instead of python) for processing
 // efficiency - the repetitive integer math is vastly faster in C.
 
+#include <math.h> // INFINITY
+#include <pthread.h> // pthread_mutex_lock
 #include <stddef.h> // offsetof
 #include <stdint.h> // uint32_t
 #include <stdio.h> // fprintf
@@ -38,8 +40,17 @@ struct stepcompress {
     struct list_head msg_queue;
     uint32_t queue_step_msgid, set_next_step_dir_msgid, oid;
     int sdir, invert_sdir;
+    // Deferred step generation
+    stepcompress_gen_callback gen_cb;
+    void *gen_data;
+    // Lock held while the steppersync thread is flushing this object
+    pthread_mutex_t *sync_lock;
+    struct steppersync *sync;
 };
 
+static void steppersync_remove(struct steppersync *ss
+                               , struct stepcompress *sc);
+
 
 /****************************************************************
  * Step compression
@@ -256,6 +267,9 @@ stepcompress_free(struct stepcompress *sc)
 {
     if (!sc)
         return;
+    if (sc->sync)
+        // Don't leave a dangling reference in the steppersync
+        steppersync_remove(sc->sync, sc);
     free(sc->queue);
     message_queue_free(&sc->msg_queue);
     free(sc);
@@ -332,41 +346,115 @@ set_next_step_dir(struct stepcompress *sc, int sdir)
     return 0;
 }
 
+// Generate any deferred step times prior to the given print_time
+static int
+stepcompress_generate(struct stepcompress *sc, double flush_time)
+{
+    if (!sc->gen_cb)
+        return 0;
+    return sc->gen_cb(sc->gen_data, flush_time);
+}
+
+// Generate and flush all pending steps
+static int
+stepcompress_flush_all(struct stepcompress *sc)
+{
+    int ret = stepcompress_generate(sc, INFINITY);
+    if (ret)
+        return ret;
+    return stepcompress_flush(sc, UINT64_MAX);
+}
+
+// Exclude the steppersync background thread from this object (must
+// be held by callers outside of the steppersync code that modify or
+// inspect the step queue after the steppersync has been created)
+void
+stepcompress_lock(struct stepcompress *sc)
+{
+    if (sc && sc->sync_lock)
+        pthread_mutex_lock(sc->sync_lock);
+}
+
+void
+stepcompress_unlock(struct stepcompress *sc)
+{
+    if (sc && sc->sync_lock)
+        pthread_mutex_unlock(sc->sync_lock);
+}
+
+// Register the code that generates step times on demand (any steps
+// pending with a previously registered generator are created first -
+// caller must hold the stepcompress lock)
+int
+stepcompress_set_generator(struct stepcompress *sc
+                           , stepcompress_gen_callback gen_cb, void *gen_data)
+{
+    int ret = stepcompress_generate(sc, INFINITY);
+    if (!ret) {
+        sc->gen_cb = gen_cb;
+        sc->gen_data = gen_data;
+    }
+    return ret;
+}
+
 // Reset the internal state of the stepcompress object
 int __visible
 stepcompress_reset(struct stepcompress *sc, uint64_t last_step_clock)
 {
-    int ret = stepcompress_flush(sc, UINT64_MAX);
-    if (ret)
-        return ret;
-    sc->last_step_clock = last_step_clock;
-    sc->sdir = -1;
-    return 0;
+    stepcompress_lock(sc);
+    int ret = stepcompress_flush_all(sc);
+    if (!ret) {
+        sc->last_step_clock = last_step_clock;
+        sc->sdir = -1;
+    }
+    stepcompress_unlock(sc);
+    return ret;
 }
 
 // Indicate the stepper is in homing mode (or done homing if zero)
 int __visible
 stepcompress_set_homing(struct stepcompress *sc, uint64_t homing_clock)
 {
-    int ret = stepcompress_flush(sc, UINT64_MAX);
-    if (ret)
-        return ret;
-    sc->homing_clock = homing_clock;
-    return 0;
+    stepcompress_lock(sc);
+    int ret = stepcompress_flush_all(sc);
+    if (!ret)
+        sc->homing_clock = homing_clock;
+    stepcompress_unlock(sc);
+    return ret;
 }
 
 // Queue an mcu command to go out in order with stepper commands
 int __visible
 stepcompress_queue_msg(struct stepcompress *sc, uint32_t *data, int len)
 {
-    int ret = stepcompress_flush(sc, UINT64_MAX);
-    if (ret)
-        return ret;
+    stepcompress_lock(sc);
+    int ret = stepcompress_flush_all(sc);
+    if (!ret) {
+        struct queue_message *qm = message_alloc_and_encode(data, len);
+        qm->req_clock = sc->homing_clock ?: sc->last_step_clock;
+        list_add_tail(&qm->node, &sc->msg_queue);
+    }
+    stepcompress_unlock(sc);
+    return ret;
+}
 
-    struct queue_message *qm = message_alloc_and_encode(data, len);
-    qm->req_clock = sc->homing_clock ?: sc->last_step_clock;
-    list_add_tail(&qm->node, &sc->msg_queue);
-    return 0;
+// Queue an mcu command that uses an item in the mcu 'move queue'
+// (the item is freed by the mcu at req_clock)
+int __visible
+stepcompress_queue_move_msg(struct stepcompress *sc, uint64_t req_clock
+                            , uint32_t *data, int len)
+{
+    if (!req_clock)
+        return ERROR_RET;
+    stepcompress_lock(sc);
+    int ret = stepcompress_flush_all(sc);
+    if (!ret) {
+        struct queue_message *qm = message_alloc_and_encode(data, len);
+        qm->min_clock = qm->req_clock = req_clock;
+        list_add_tail(&qm->node, &sc->msg_queue);
+    }
+    stepcompress_unlock(sc);
+    return ret;
 }
 
 // Set the conversion rate of 'print_time' to mcu clock
@@ -520,6 +608,10 @@ queue_append_set_next_step_dir(struct queue_append *qa, int sdir)
 // free so that new commands can be transmitted.  It also ensures the
 // mcu step queue is ordered between steppers so that no stepper
 // starves the other steppers of space in the mcu step queue.
+//
+// Lazy flushes are performed by a background thread so that step
+// generation and compression run in parallel with the host's
+// g-code processing and move planning.
 
 struct steppersync {
     // Serial port
@@ -531,8 +623,49 @@ struct steppersync {
     // Storage for list of pending move clocks
     uint64_t *move_clocks;
     int num_move_clocks;
+    // Lazy flush scheduling
+    uint64_t flush_ticks, next_flush_clock;
+    int lazy_count;
+    // Background thread
+    pthread_t tid;
+    pthread_mutex_t lock; // held while flushing the stepcompress objects
+    pthread_mutex_t work_lock; // protects variables below
+    pthread_cond_t work_cond;
+    uint64_t work_clock;
+    int work_pending, work_error, must_exit;
 };
 
+static int steppersync_do_flush(struct steppersync *ss, uint64_t move_clock);
+
+// Main code for the steppersync background thread
+static void *
+steppersync_background(void *data)
+{
+    struct steppersync *ss = data;
+    pthread_mutex_lock(&ss->work_lock);
+    for (;;) {
+        if (ss->must_exit)
+            break;
+        if (!ss->work_pending) {
+            pthread_cond_wait(&ss->work_cond, &ss->work_lock);
+            continue;
+        }
+        uint64_t move_clock = ss->work_clock;
+        ss->work_pending = 0;
+        pthread_mutex_unlock(&ss->work_lock);
+
+        pthread_mutex_lock(&ss->lock);
+        int ret = steppersync_do_flush(ss, move_clock);
+        pthread_mutex_unlock(&ss->lock);
+
+        pthread_mutex_lock(&ss->work_lock);
+        if (ret && !ss->work_error)
+            ss->work_error = ret;
+    }
+    pthread_mutex_unlock(&ss->work_lock);
+    return NULL;
+}
+
 // Allocate a new 'steppersync' object
 struct steppersync * __visible
 steppersync_alloc(struct serialqueue *sq, struct stepcompress **sc_list
@@ -551,7 +684,53 @@ steppersync_alloc(struct serialqueue *sq, struct stepcompress **sc_list
     memset(ss->move_clocks, 0, sizeof(*ss->move_clocks)*move_num);
     ss->num_move_clocks = move_num;
 
+    // Thread setup
+    int ret = pthread_mutex_init(&ss->lock, NULL);
+    if (ret)
+        goto fail;
+    ret = pthread_mutex_init(&ss->work_lock, NULL);
+    if (ret)
+        goto fail;
+    ret = pthread_cond_init(&ss->work_cond, NULL);
+    if (ret)
+        goto fail;
+    ret = pthread_create(&ss->tid, NULL, steppersync_background, ss);
+    if (ret)
+        goto fail;
+    int i;
+    for (i=0; i<sc_num; i++) {
+        sc_list[i]->sync_lock = &ss->lock;
+        sc_list[i]->sync = ss;
+    }
+
     return ss;
+
+fail:
+    report_errno("steppersync init", ret);
+    free(ss->sc_list);
+    free(ss->move_clocks);
+    serialqueue_free_commandqueue(ss->cq);
+    free(ss);
+    return NULL;
+}
+
+// Remove a stepcompress object that is being freed from a steppersync
+static void
+steppersync_remove(struct steppersync *ss, struct stepcompress *sc)
+{
+    pthread_mutex_lock(&ss->lock);
+    int i;
+    for (i=0; i<ss->sc_num; i++) {
+        if (ss->sc_list[i] != sc)
+            continue;
+        ss->sc_num--;
+        memmove(&ss->sc_list[i], &ss->sc_list[i+1]
+                , (ss->sc_num - i) * sizeof(*ss->sc_list));
+        break;
+    }
+    sc->sync_lock = NULL;
+    sc->sync = NULL;
+    pthread_mutex_unlock(&ss->lock);
 }
 
 // Free memory associated with a 'steppersync' object
@@ -560,6 +739,18 @@ steppersync_free(struct steppersync *ss)
 {
     if (!ss)
         return;
+    pthread_mutex_lock(&ss->work_lock);
+    ss->must_exit = 1;
+    pthread_cond_signal(&ss->work_cond);
+    pthread_mutex_unlock(&ss->work_lock);
+    int ret = pthread_join(ss->tid, NULL);
+    if (ret)
+        report_errno("steppersync pthread_join", ret);
+    int i;
+    for (i=0; i<ss->sc_num; i++) {
+        ss->sc_list[i]->sync_lock = NULL;
+        ss->sc_list[i]->sync = NULL;
+    }
     free(ss->sc_list);
     free(ss->move_clocks);
     serialqueue_free_commandqueue(ss->cq);
@@ -571,11 +762,23 @@ void __visible
 steppersync_set_time(struct steppersync *ss, double time_offset
                      , double mcu_freq)
 {
+    pthread_mutex_lock(&ss->lock);
     int i;
     for (i=0; i<ss->sc_num; i++) {
         struct stepcompress *sc = ss->sc_list[i];
         stepcompress_set_time(sc, time_offset, mcu_freq);
     }
+    pthread_mutex_unlock(&ss->lock);
+}
+
+// Set the minimum amount the flush point must advance (in mcu clock
+// ticks) before steppersync_flush_lazy() transmits queued steps
+void __visible
+steppersync_set_flush_interval(struct steppersync *ss, uint64_t flush_ticks)
+{
+    pthread_mutex_lock(&ss->lock);
+    ss->flush_ticks = flush_ticks;
+    pthread_mutex_unlock(&ss->lock);
 }
 
 // Implement a binary heap algorithm to track when the next available
@@ -604,13 +807,21 @@ heap_replace(struct steppersync *ss, uint64_t req_clock)
 }
 
 // Find and transmit any scheduled steps prior to the given 'move_clock'
-int __visible
-steppersync_flush(struct steppersync *ss, uint64_t move_clock)
+static int
+steppersync_do_flush(struct steppersync *ss, uint64_t move_clock)
 {
-    // Flush each stepcompress to the specified move_clock
+    // Generate steps up to one flush interval past move_clock (the
+    // extra steps give the compression code some lookahead) and then
+    // flush each stepcompress to the specified move_clock
     int i;
     for (i=0; i<ss->sc_num; i++) {
-        int ret = stepcompress_flush(ss->sc_list[i], move_clock);
+        struct stepcompress *sc = ss->sc_list[i];
+        double gen_clock = (double)move_clock + (double)ss->flush_ticks;
+        double flush_time = sc->mcu_time_offset + gen_clock / sc->mcu_freq;
+        int ret = stepcompress_generate(sc, flush_time);
+        if (ret)
+            return ret;
+        ret = stepcompress_flush(sc, move_clock);
         if (ret)
             return ret;
     }
@@ -655,3 +866,54 @@ steppersync_flush(struct steppersync *ss, uint64_t move_clock)
         serialqueue_send_batch(ss->sq, ss->cq, &msgs);
     return 0;
 }
+
+// Return (and clear) any error reported by the background thread
+static int
+steppersync_get_work_error(struct steppersync *ss)
+{
+    int ret = ss->work_error;
+    ss->work_error = 0;
+    return ret;
+}
+
+// Generate and transmit all steps prior to the given 'move_clock' (the
+// work is completed before this function returns)
+int __visible
+steppersync_flush(struct steppersync *ss, uint64_t move_clock)
+{
+    pthread_mutex_lock(&ss->lock);
+    int ret = steppersync_do_flush(ss, move_clock);
+    pthread_mutex_unlock(&ss->lock);
+    pthread_mutex_lock(&ss->work_lock);
+    if (ss->work_pending && ss->work_clock <= move_clock)
+        ss->work_pending = 0;
+    ss->next_flush_clock = move_clock + ss->flush_ticks;
+    ss->lazy_count = 0;
+    int work_ret = steppersync_get_work_error(ss);
+    pthread_mutex_unlock(&ss->work_lock);
+    return ret ?: work_ret;
+}
+
+// Maximum number of lazy flush requests (one per queued toolhead
+// move) that may be deferred before a flush is forced
+#define LAZY_FLUSH_MAX_MOVES 256
+
+// Request that the background thread flush steps prior to
+// 'move_clock' if the flush point has advanced at least 'flush_ticks'
+// since the last flush (or a large backlog of moves is pending)
+int __visible
+steppersync_flush_lazy(struct steppersync *ss, uint64_t move_clock)
+{
+    pthread_mutex_lock(&ss->work_lock);
+    if (move_clock >= ss->next_flush_clock
+        || ++ss->lazy_count >= LAZY_FLUSH_MAX_MOVES) {
+        ss->next_flush_clock = move_clock + ss->flush_ticks;
+        ss->lazy_count = 0;
+        ss->work_clock = move_clock;
+        ss->work_pending = 1;
+        pthread_cond_signal(&ss->work_cond);
+    }
+    int ret = steppersync_get_work_error(ss);
+    pthread_mutex_unlock(&ss->work_lock);
+    return ret;
+}
@@ -13,6 +13,14 @@ void stepcompress_free(struct stepcompress *sc);
 int stepcompress_reset(struct stepcompress *sc, uint64_t last_step_clock);
 int stepcompress_set_homing(struct stepcompress *sc, uint64_t homing_clock);
 int stepcompress_queue_msg(struct stepcompress *sc, uint32_t *data, int len);
+int stepcompress_queue_move_msg(struct stepcompress *sc, uint64_t req_clock
+                                , uint32_t *data, int len);
+void stepcompress_lock(struct stepcompress *sc);
+void stepcompress_unlock(struct stepcompress *sc);
+typedef int32_t (*stepcompress_gen_callback)(void *data, double flush_time);
+int stepcompress_set_generator(struct stepcompress *sc
+                               , stepcompress_gen_callback gen_cb
+                               , void *gen_data);
 double stepcompress_get_mcu_freq(struct stepcompress *sc);
 uint32_t stepcompress_get_oid(struct stepcompress *sc);
 int stepcompress_get_step_dir(struct stepcompress *sc);
@@ -35,6 +43,9 @@ struct steppersync *steppersync_alloc(
 void steppersync_free(struct steppersync *ss);
 void steppersync_set_time(struct steppersync *ss, double time_offset
                           , double mcu_freq);
+void steppersync_set_flush_interval(struct steppersync *ss
+                                    , uint64_t flush_ticks);
 int steppersync_flush(struct steppersync *ss, uint64_t move_clock);
+int steppersync_flush_lazy(struct steppersync *ss, uint64_t move_clock);
 
 #endif // stepcompress.h
@@ -191,8 +191,12 @@ class BedMeshCalibrate:
         self.probed_z_table = None
         self.build_map = False
         self.probe_params = collections.OrderedDict()
+        self.mesh_grid = None
+        self.mesh_area = None
         points = self._generate_points(config)
         self._init_probe_params(config, points)
+        self.full_points = points
+        self.full_params = collections.OrderedDict(self.probe_params)
         self.probe_helper = probe.ProbePointsHelper(
             config, self.probe_finalize, points)
         # setup persistent storage
@@ -245,9 +249,23 @@ class BedMeshCalibrate:
             new_r = (x_cnt / 2) * x_dist
             min_x = min_y = -new_r
             max_x = max_y = new_r
-        else:
-            # rectangular bed, only re-calc max_x
-            max_x = min_x + x_dist * (x_cnt - 1)
+        self.mesh_grid = (min_x, min_y, x_dist, y_dist, x_cnt, y_cnt)
+        points = self._build_points(min_x, min_y, x_dist, y_dist, x_cnt, y_cnt)
+        logging.info('bed_mesh: generated points')
+        for i, p in enumerate(points):
+            logging.info("%d: (%.1f, %.1f)" % (i, p[0], p[1]))
+        rref_index = config.get('relative_reference_index', None)
+        if rref_index is not None:
+            rref_index = int(rref_index)
+            if rref_index < 0 or rref_index >= len(points):
+                raise config.error("bed_mesh: relative reference index %d "
+                    "is out of bounds" % (rref_index))
+            logging.info("bed_mesh: relative_reference_index %d is (%.2f, %.2f)"
+                % (rref_index, points[rref_index][0], points[rref_index][1]))
+            self.relative_reference_index = rref_index
+        return points
+    def _build_points(self, min_x, min_y, x_dist, y_dist, x_cnt, y_cnt):
+        max_x = min_x + x_dist * (x_cnt - 1)
         pos_y = min_y
         points = []
         for i in range(y_cnt):
@@ -267,19 +285,114 @@ class BedMeshCalibrate:
                     if dist_from_origin <= self.radius:
                         points.append((pos_x, pos_y))
             pos_y += y_dist
-        logging.info('bed_mesh: generated points')
-        for i, p in enumerate(points):
-            logging.info("%d: (%.1f, %.1f)" % (i, p[0], p[1]))
-        rref_index = config.get('relative_reference_index', None)
-        if rref_index is not None:
-            rref_index = int(rref_index)
-            if rref_index < 0 or rref_index >= len(points):
-                raise config.error("bed_mesh: relative reference index %d "
-                    "is out of bounds" % (rref_index))
-            logging.info("bed_mesh: relative_reference_index %d is (%.2f, %.2f)"
-                % (rref_index, points[rref_index][0], points[rref_index][1]))
-            self.relative_reference_index = rref_index
         return points
+    def _calc_area_range(self, area_min, area_max, grid_min, dist, cnt):
+        # Find the grid lines (at the configured spacing) enclosing an area
+        start = int(math.floor((area_min - grid_min) / dist + .001))
+        end = int(math.ceil((area_max - grid_min) / dist - .001))
+        start = constrain(start, 0, cnt - 1)
+        end = constrain(end, 0, cnt - 1)
+        while end - start < 2:
+            # At least three points are needed along each axis
+            if start > 0:
+                start -= 1
+            if end - start < 2 and end < cnt - 1:
+                end += 1
+        return start, end
+    def _setup_area(self, params):
+        # Restrict probing to the part of the mesh covering a print area
+        self.mesh_area = None
+        self.probe_helper.update_probe_points(self.full_points)
+        self.probe_params.update(self.full_params)
+        area = None
+        mesh_min = self.gcode.get_str('MESH_MIN', params, None)
+        mesh_max = self.gcode.get_str('MESH_MAX', params, None)
+        if mesh_min is not None or mesh_max is not None:
+            try:
+                min_x, min_y = [float(v) for v in mesh_min.split(',')]
+                max_x, max_y = [float(v) for v in mesh_max.split(',')]
+            except:
+                raise self.gcode.error(
+                    "bed_mesh: MESH_MIN and MESH_MAX must both be of the"
+                    " form x,y")
+            area = (min_x, min_y, max_x, max_y)
+        elif self.gcode.get_int('PRINT_AREA', params, 0):
+            sdcard = self.printer.lookup_object('virtual_sdcard', None)
+            if sdcard is not None:
+                area = sdcard.get_print_area()
+            if area is None:
+                raise self.gcode.error(
+                    "bed_mesh: Unable to determine print area")
+        if area is None:
+            return
+        if self.radius is not None:
+            raise self.gcode.error(
+                "bed_mesh: Probing a print area requires a rectangular bed")
+        min_x, min_y, max_x, max_y = area
+        if max_x < min_x or max_y < min_y:
+            raise self.gcode.error("bed_mesh: Invalid print area")
+        # Convert the nozzle area to probe point coordinates
+        probe = self.printer.lookup_object('probe', None)
+        method = self.gcode.get_str('METHOD', params, 'automatic').lower()
+        x_offset = y_offset = 0.
+        if probe is not None and method == 'automatic':
+            x_offset, y_offset = probe.get_offsets()[:2]
+        grid_x, grid_y, x_dist, y_dist, x_cnt, y_cnt = self.mesh_grid
+        x_start, x_end = self._calc_area_range(
+            min_x - x_offset, max_x - x_offset, grid_x, x_dist, x_cnt)
+        y_start, y_end = self._calc_area_range(
+            min_y - y_offset, max_y - y_offset, grid_y, y_dist, y_cnt)
+        area_x_cnt = x_end - x_start + 1
+        area_y_cnt = y_end - y_start + 1
+        if area_x_cnt == x_cnt and area_y_cnt == y_cnt:
+            # Print area needs the full mesh
+            return
+        points = self._build_points(
+            grid_x + x_start * x_dist, grid_y + y_start * y_dist,
+            x_dist, y_dist, area_x_cnt, area_y_cnt)
+        rref_index = None
+        if self.relative_reference_index is not None:
+            rx, ry = self.full_points[self.relative_reference_index]
+            for i, (px, py) in enumerate(points):
+                if (isclose(px, rx, abs_tol=.01)
+                    and isclose(py, ry, abs_tol=.01)):
+                    rref_index = i
+                    break
+            else:
+                raise self.gcode.error(
+                    "bed_mesh: relative_reference_index point is outside"
+                    " of the print area")
+        self.mesh_area = (x_start, y_start, rref_index)
+        self.probe_params['x_count'] = area_x_cnt
+        self.probe_params['y_count'] = area_y_cnt
+        self.probe_params['min_x'] = min([p[0] for p in points])
+        self.probe_params['max_x'] = max([p[0] for p in points])
+        self.probe_params['min_y'] = min([p[1] for p in points])
+        self.probe_params['max_y'] = max([p[1] for p in points])
+        self.probe_helper.update_probe_points(points)
+        self.gcode.respond_info(
+            "bed_mesh: probing %d of %d points for print area" % (
+                len(points), len(self.full_points)))
+    def _merge_area(self, offsets):
+        # Merge probed print area into a stored full mesh (if available)
+        x_start, y_start, rref_index = self.mesh_area
+        profile = self.profiles.get("default", None)
+        if profile is None:
+            return
+        params = profile['probe_params']
+        for key in ['x_count', 'y_count', 'min_x', 'max_x', 'min_y', 'max_y']:
+            if not isclose(params[key], self.full_params[key], abs_tol=.001):
+                return
+        if (not isclose(params['x_offset'], offsets[0], abs_tol=.001)
+            or not isclose(params['y_offset'], offsets[1], abs_tol=.001)):
+            return
+        z_table = [list(row) for row in profile['points']]
+        for j, row in enumerate(self.probed_z_table):
+            z_table[y_start + j][x_start:x_start + len(row)] = row
+        self.probed_z_table = z_table
+        self.probe_params.update(self.full_params)
+        self.probe_params['x_offset'] = offsets[0]
+        self.probe_params['y_offset'] = offsets[1]
     def _init_probe_params(self, config, points):
         self.probe_params['min_x'] = min(points, key=lambda p: p[0])[0]
         self.probe_params['max_x'] = max(points, key=lambda p: p[0])[0]
@@ -402,6 +515,7 @@ class BedMeshCalibrate:
         self.build_map = False
         self.start_calibration(params)
     def start_calibration(self, params):
+        self._setup_area(params)
         self.bedmesh.set_mesh(None)
         self.probe_helper.start_probe(params)
     def print_probed_positions(self, print_func):
@@ -421,10 +535,13 @@ class BedMeshCalibrate:
         x_cnt = self.probe_params['x_count']
         y_cnt = self.probe_params['y_count']
 
-        if self.relative_reference_index is not None:
+        rref_index = self.relative_reference_index
+        if self.mesh_area is not None:
+            rref_index = self.mesh_area[2]
+        if rref_index is not None:
             # zero out probe z offset and
             # set offset relative to reference index
-            z_offset = positions[self.relative_reference_index][2]
+            z_offset = positions[rref_index][2]
 
         self.probed_z_table = []
         row = []
@@ -487,6 +604,8 @@ class BedMeshCalibrate:
             self.gcode.respond(
                 "mesh_map_output " + json.dumps(outdict))
         else:
+            if self.mesh_area is not None:
+                self._merge_area(offsets)
             mesh = ZMesh(self.probe_params)
             try:
                 mesh.build_mesh(self.probed_z_table)
@@ -42,6 +42,7 @@ class MCU_SPI:
         self.cmd_queue = self.mcu.alloc_command_queue()
         self.mcu.register_config_callback(self.build_config)
         self.spi_send_cmd = self.spi_transfer_cmd = None
+        self.spi_schedule_send_cmd = None
     def get_oid(self):
         return self.oid
     def get_mcu(self):
@@ -55,6 +56,8 @@ class MCU_SPI:
             "spi_send oid=%c data=%*s", cq=self.cmd_queue)
         self.spi_transfer_cmd = self.mcu.lookup_command(
             "spi_transfer oid=%c data=%*s", cq=self.cmd_queue)
+        self.spi_schedule_send_cmd = self.mcu.lookup_command(
+            "spi_schedule_send oid=%c clock=%u data=%*s", cq=self.cmd_queue)
     def spi_send(self, data, minclock=0, reqclock=0):
         if self.spi_send_cmd is None:
             # Send setup message via mcu initialization
@@ -64,6 +67,10 @@ class MCU_SPI:
             return
         self.spi_send_cmd.send([self.oid, data],
                                minclock=minclock, reqclock=reqclock)
+    def spi_schedule_send(self, data, clock, minclock=0):
+        # Send the data at the given mcu clock
+        self.spi_schedule_send_cmd.send([self.oid, clock, data],
+                                        minclock=minclock, reqclock=clock)
     def spi_transfer(self, data):
         return self.spi_transfer_cmd.send_with_response(
             [self.oid, data], 'spi_transfer_response', self.oid)
@@ -3,10 +3,13 @@
 # Copyright (C) 2019  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
+import logging
 import stepper, homing, force_move, chelper
 
 ENDSTOP_SAMPLE_TIME = .000015
 ENDSTOP_SAMPLE_COUNT = 4
+ASYNC_BUFFER_TIME = 0.250
+ASYNC_FLUSH_TIME = 0.500
 
 class ManualStepper:
     def __init__(self, config):
@@ -21,6 +24,10 @@ class ManualStepper:
         self.velocity = config.getfloat('velocity', 5., above=0.)
         self.accel = config.getfloat('accel', 0., minval=0.)
         self.next_cmd_time = 0.
+        # Flushing of moves scheduled independently of the toolhead
+        self.reactor = self.printer.get_reactor()
+        self.mcu = self.stepper.get_mcu()
+        self.flush_timer = self.reactor.register_timer(self._flush_handler)
         # Setup iterative solver
         ffi_main, ffi_lib = chelper.get_ffi()
         self.cmove = ffi_main.gc(ffi_lib.move_alloc(), ffi_lib.free)
@@ -48,8 +55,35 @@ class ManualStepper:
         self.sync_print_time()
     def do_set_position(self, setpos):
         self.stepper.set_position([setpos, 0., 0.])
-    def do_move(self, movepos, speed, accel):
-        self.sync_print_time()
+    def _flush_handler(self, eventtime):
+        # Transmit the steps of unsynchronized moves shortly before
+        # they are needed (the toolhead may not be flushing moves)
+        try:
+            flush_time = self.next_cmd_time
+            if not self.mcu.is_fileoutput():
+                est_print_time = self.mcu.estimated_print_time(eventtime)
+                flush_time = min(flush_time, est_print_time + ASYNC_FLUSH_TIME)
+            self.mcu.flush_moves(flush_time)
+            if flush_time < self.next_cmd_time:
+                return eventtime + ASYNC_FLUSH_TIME * .5
+        except:
+            logging.exception("Exception in manual_stepper flush_handler")
+            self.printer.invoke_shutdown(
+                "Exception in manual_stepper flush_handler")
+        return self.reactor.NEVER
+    def _async_print_time(self):
+        # Schedule a move without waiting on (or stalling) the toolhead
+        curtime = self.reactor.monotonic()
+        est_print_time = self.mcu.estimated_print_time(curtime)
+        self.next_cmd_time = max(self.next_cmd_time,
+                                 est_print_time + ASYNC_BUFFER_TIME)
+    def do_move(self, movepos, speed, accel, sync=True):
+        if sync:
+            self.sync_print_time()
+        else:
+            self._async_print_time()
+            if not self.stepper.is_motor_enabled():
+                self.stepper.motor_enable(self.next_cmd_time, 1)
         cp = self.stepper.get_commanded_position()
         dist = movepos - cp
         accel_t, cruise_t, cruise_v = force_move.calc_move_time(
@@ -60,7 +94,10 @@ class ManualStepper:
                        0., cruise_v, accel)
         self.stepper.step_itersolve(self.cmove)
         self.next_cmd_time += accel_t + cruise_t + accel_t
-        self.sync_print_time()
+        if sync:
+            self.sync_print_time()
+        else:
+            self.reactor.update_timer(self.flush_timer, self.reactor.NOW)
     def do_homing_move(self, movepos, speed, accel, triggered):
         if not self.can_home:
             raise self.gcode.error("No endstop for this manual stepper")
@@ -103,6 +140,7 @@ class ManualStepper:
             setpos = self.gcode.get_float('SET_POSITION', params)
             self.do_set_position(setpos)
         homing_move = self.gcode.get_int('STOP_ON_ENDSTOP', params, 0)
+        sync = self.gcode.get_int('SYNC', params, 1)
         speed = self.gcode.get_float('SPEED', params, self.velocity, above=0.)
         accel = self.gcode.get_float('ACCEL', params, self.accel, minval=0.)
         if homing_move:
@@ -112,9 +150,13 @@ class ManualStepper:
             self.do_homing_move(movepos, speed, accel, homing_move > 0)
         elif 'MOVE' in params:
             movepos = self.gcode.get_float('MOVE', params)
-            if 'ENABLE' not in params and not self.stepper.is_motor_enabled():
+            if (sync and 'ENABLE' not in params
+                and not self.stepper.is_motor_enabled()):
                 self.do_enable(True)
-            self.do_move(movepos, speed, accel)
+            self.do_move(movepos, speed, accel, sync)
+        elif 'SYNC' in params and sync:
+            # Wait for any unsynchronized moves to complete
+            self.sync_print_time()
     def handle_motor_off(self, print_time):
         self.do_enable(0)
 
@@ -18,13 +18,20 @@ class PIDCalibrate:
         heater_name = self.gcode.get_str('HEATER', params)
         target = self.gcode.get_float('TARGET', params)
         write_file = self.gcode.get_int('WRITE_FILE', params, 0)
+        method = self.gcode.get_str('METHOD', params, 'relay').lower()
+        if method not in ('relay', 'step'):
+            raise self.gcode.error("Unknown calibration method '%s'" % (
+                method,))
         pheater = self.printer.lookup_object('heater')
         try:
             heater = pheater.lookup_heater(heater_name)
         except self.printer.config_error as e:
             raise self.gcode.error(str(e))
         print_time = self.printer.lookup_object('toolhead').get_last_move_time()
-        calibrate = ControlAutoTune(heater, target)
+        if method == 'step':
+            calibrate = ControlStepTune(heater, target)
+        else:
+            calibrate = ControlAutoTune(heater, target)
         old_control = heater.set_control(calibrate)
         try:
             heater.set_temp(print_time, target)
@@ -36,14 +43,28 @@ class PIDCalibrate:
         if write_file:
             calibrate.write_file('/tmp/heattest.txt')
         # Log and report results
-        Kp, Ki, Kd = calibrate.calc_final_pid()
+        try:
+            Kp, Ki, Kd = calibrate.calc_final_pid()
+        except heater.error as e:
+            raise self.gcode.error(str(e))
         logging.info("Autotune: final: Kp=%f Ki=%f Kd=%f", Kp, Ki, Kd)
+        configfile = self.printer.lookup_object('configfile')
+        if method == 'step':
+            gain, time_constant, dead_time = calibrate.model
+            heater.set_model(gain, time_constant, dead_time)
+            self.gcode.respond_info(
+                "Heater model: model_gain=%.3f model_time_constant=%.3f"
+                " model_dead_time=%.3f" % (gain, time_constant, dead_time))
+            configfile.set(heater_name, 'model_gain', "%.3f" % (gain,))
+            configfile.set(heater_name, 'model_time_constant',
+                           "%.3f" % (time_constant,))
+            configfile.set(heater_name, 'model_dead_time',
+                           "%.3f" % (dead_time,))
         self.gcode.respond_info(
             "PID parameters: pid_Kp=%.3f pid_Ki=%.3f pid_Kd=%.3f\n"
             "The SAVE_CONFIG command will update the printer config file\n"
             "with these parameters and restart the printer." % (Kp, Ki, Kd))
         # Store results for SAVE_CONFIG
-        configfile = self.printer.lookup_object('configfile')
         configfile.set(heater_name, 'control', 'pid')
         configfile.set(heater_name, 'pid_Kp', "%.3f" % (Kp,))
         configfile.set(heater_name, 'pid_Ki', "%.3f" % (Ki,))
@@ -140,5 +161,96 @@ class ControlAutoTune:
         f.write('\n'.join(pwm + out))
         f.close()
 
+STEP_DERIV_TIME = 2.
+STEP_FIT_START = .2
+STEP_MIN_LAMBDA = 1.
+
+# Calibration from a single step response.  The heater is run at full
+# power until the target is reached and a first-order-plus-dead-time
+# model (temperature rise of "gain" degrees per unit of power, with
+# the given time constant and dead time) is fit to the samples.
+class ControlStepTune(ControlAutoTune):
+    def __init__(self, heater, target):
+        ControlAutoTune.__init__(self, heater, target)
+        self.done = False
+        self.model = None
+    def temperature_update(self, read_time, temp, target_temp):
+        self.temp_samples.append((read_time, temp))
+        if temp >= target_temp:
+            self.done = True
+        if self.done:
+            self.set_pwm(read_time, 0.)
+        else:
+            self.set_pwm(read_time, self.heater_max_power)
+    def check_busy(self, eventtime, smoothed_temp, target_temp):
+        return not self.done
+    # Analysis
+    def calc_model(self):
+        if len(self.pwm_samples) < 2:
+            raise heater.error("Heater must start below the target")
+        step_time, power = self.pwm_samples[0]
+        end_time = self.pwm_samples[-1][0]
+        samples = [(time - step_time, temp)
+                   for time, temp in self.temp_samples
+                   if time >= step_time and time <= end_time]
+        if len(samples) < 4:
+            raise heater.error("Not enough samples for step calibration")
+        base_temp = samples[0][1]
+        rise = samples[-1][1] - base_temp
+        # The model has d(temp)/dt = (gain*power - (temp - base_temp)) / tc
+        # after the dead time - fit a line to the measured rate of change
+        points = []
+        j = 0
+        for time, temp in samples:
+            while j < len(samples) and samples[j][0] < time + STEP_DERIV_TIME:
+                j += 1
+            if j >= len(samples):
+                break
+            next_time, next_temp = samples[j]
+            x = .5 * (temp + next_temp) - base_temp
+            if x >= STEP_FIT_START * rise:
+                points.append((x, (next_temp - temp) / (next_time - time)))
+        if len(points) < 2:
+            raise heater.error("Not enough samples for step calibration")
+        mean_x = sum([x for x, y in points]) / len(points)
+        mean_y = sum([y for x, y in points]) / len(points)
+        sxx = sum([(x - mean_x)**2 for x, y in points])
+        sxy = sum([(x - mean_x) * (y - mean_y) for x, y in points])
+        if not sxx or sxy >= 0.:
+            raise heater.error(
+                "Unable to fit heater model (try a higher target)")
+        time_constant = -sxx / sxy
+        final_rise = (mean_y + mean_x / time_constant) * time_constant
+        gain = final_rise / power
+        # Find the dead time that best matches the measured samples
+        dead_times = []
+        for time, temp in samples:
+            sample_rise = temp - base_temp
+            if (sample_rise >= STEP_FIT_START * rise
+                and sample_rise < final_rise):
+                dead_times.append(time + time_constant * math.log(
+                    1. - sample_rise / final_rise))
+        if not dead_times:
+            raise heater.error("Unable to fit heater model")
+        dead_times.sort()
+        dead_time = max(0., dead_times[len(dead_times)/2])
+        logging.info("Autotune: step model: gain=%f time_constant=%f"
+                     " dead_time=%f (rise=%f)", gain, time_constant,
+                     dead_time, rise)
+        return gain, time_constant, dead_time
+    def calc_final_pid(self):
+        self.model = gain, time_constant, dead_time = self.calc_model()
+        # Use the IMC tuning rules for a first-order-plus-dead-time model
+        closed_loop_time = max(dead_time, STEP_MIN_LAMBDA)
+        Kc = ((time_constant + .5 * dead_time)
+              / (gain * (closed_loop_time + .5 * dead_time)))
+        Ti = time_constant + .5 * dead_time
+        Td = time_constant * dead_time / (2. * time_constant + dead_time)
+        Kp = Kc * heater.PID_PARAM_BASE
+        Ki = Kp / Ti
+        Kd = Kp * Td
+        logging.info("Autotune: step Kp=%f Ki=%f Kd=%f", Kp, Ki, Kd)
+        return Kp, Ki, Kd
+
 def load_config(config):
     return PIDCalibrate(config)
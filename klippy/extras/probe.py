@@ -18,6 +18,11 @@ class PrinterProbe:
         self.name = config.get_name()
         self.mcu_probe = mcu_probe
         self.speed = config.getfloat('speed', 5.0)
+        self.fast_speed = config.getfloat('fast_speed', None, above=0.)
+        self.samples_tolerance = config.getfloat(
+            'samples_tolerance', 0., minval=0.)
+        self.samples_retries = config.getint(
+            'samples_tolerance_retries', 0, minval=0)
         self.x_offset = config.getfloat('x_offset', 0.)
         self.y_offset = config.getfloat('y_offset', 0.)
         self.z_offset = config.getfloat('z_offset')
@@ -52,7 +57,7 @@ class PrinterProbe:
     cmd_PROBE_help = "Probe Z-height at current XY position"
     def cmd_PROBE(self, params):
         self._probe(self.speed)
-    def _probe(self, speed):
+    def _probe(self, speed, quiet=False):
         toolhead = self.printer.lookup_object('toolhead')
         homing_state = homing.Homing(self.printer)
         pos = toolhead.get_position()
@@ -68,9 +73,60 @@ class PrinterProbe:
                 reason += HINT_TIMEOUT
             raise self.gcode.error(reason)
         pos = toolhead.get_position()
-        self.gcode.respond_info("probe at %.3f,%.3f is z=%.6f" % (
-            pos[0], pos[1], pos[2]))
+        if not quiet:
+            self.gcode.respond_info("probe at %.3f,%.3f is z=%.6f" % (
+                pos[0], pos[1], pos[2]))
         self.gcode.reset_last_position()
+        return pos
+    def _lift_above(self, positions, retract_dist, speed):
+        # Lift relative to the highest observed trigger height so the
+        # probe is reliably released before the next approach
+        z = max([pos[2] for pos in positions]) + retract_dist
+        self._move([None, None, z], speed)
+    def _find_agreeing(self, positions, samples):
+        # Find 'samples' positions within samples_tolerance of each other
+        if len(positions) < samples:
+            return None
+        if not self.samples_tolerance:
+            return positions
+        positions = sorted(positions, key=(lambda p: p[2]))
+        best = min(range(len(positions) - samples + 1),
+                   key=(lambda i: positions[i+samples-1][2] - positions[i][2]))
+        agreeing = positions[best:best+samples]
+        if agreeing[-1][2] - agreeing[0][2] > self.samples_tolerance:
+            return None
+        return agreeing
+    def run_probe(self, samples, retract_dist, lift_speed, use_median=False):
+        # Probe the current XY position until 'samples' probes agree
+        positions = []
+        if self.fast_speed is not None:
+            # Quickly locate the bed before taking the samples
+            pos = self._probe(self.fast_speed, quiet=True)
+            self._lift_above([pos], retract_dist, lift_speed)
+        max_attempts = samples
+        if self.samples_tolerance:
+            max_attempts += self.samples_retries
+        while 1:
+            positions.append(self._probe(self.speed))
+            agreeing = self._find_agreeing(positions, samples)
+            if agreeing is not None:
+                break
+            if len(positions) >= max_attempts:
+                raise self.gcode.error(
+                    "Probe samples exceed samples_tolerance")
+            self._lift_above(positions, retract_dist, lift_speed)
+        if not use_median:
+            return [sum([pos[i] for pos in agreeing]) / len(agreeing)
+                    for i in range(3)]
+        z_positions = sorted([pos[2] for pos in agreeing])
+        middle = len(z_positions) // 2
+        if (len(z_positions) & 1) == 1:
+            # odd number of samples
+            median = z_positions[middle]
+        else:
+            # even number of samples
+            median = (z_positions[middle] + z_positions[middle-1]) / 2
+        return [agreeing[0][0], agreeing[0][1], median]
     cmd_QUERY_PROBE_help = "Return the status of the z-probe"
     def cmd_QUERY_PROBE(self, params):
         toolhead = self.printer.lookup_object('toolhead')
@@ -92,22 +148,30 @@ class PrinterProbe:
             'Z', params, default=10., minval=self.z_offset, maxval=70.)
         x_start_position = self.gcode.get_float('X', params, default=pos[0])
         y_start_position = self.gcode.get_float('Y', params, default=pos[1])
+        retract_dist = self.gcode.get_float(
+            'SAMPLE_RETRACT_DIST', params, default=2., above=0.)
         start_pos = [x_start_position, y_start_position, z_start_position]
         self.gcode.respond_info("probe accuracy: at X:%.3f Y:%.3f Z:%.3f\n"
                                 "                "
                                 "and read %d times with speed of %d mm/s" % (
                                 x_start_position, y_start_position,
                                 z_start_position, number_of_reads, speed))
-        # Probe bed "number_of_reads" times
+        # Move Z to start reading position
+        self._move(start_pos, speed)
+        if self.fast_speed is not None:
+            # Quickly locate the bed before taking the samples
+            pos = self._probe(self.fast_speed, quiet=True)
+            self._lift_above([pos], retract_dist, speed)
+        # Probe bed "number_of_reads" times (only retracting
+        # SAMPLE_RETRACT_DIST above the bed between reads)
         sum_reads = 0
         for i in range(number_of_reads):
-            # Move Z to start reading position
-            self._move(start_pos, speed)
+            if i:
+                self._lift_above([pos], retract_dist, speed)
             # Probe
-            self._probe(speed)
+            pos = self._probe(speed)
             # Get Z value, accumulate value to calculate average
             # and save it to calculate standard deviation
-            pos = toolhead.get_position()
             sum_reads += pos[2]
             probes.append(pos[2])
         # Move Z to start reading position
@@ -248,6 +312,8 @@ class ProbePointsHelper:
         self.gcode = self.toolhead = None
     def get_lift_speed(self):
         return self.lift_speed
+    def update_probe_points(self, points):
+        self.probe_points = points
     def _lift_z(self, z_pos, add=False, speed=None):
         # Lift toolhead
         curpos = self.toolhead.get_position()
@@ -286,36 +352,14 @@ class ProbePointsHelper:
             manual_probe.ManualProbeHelper(self.printer, {},
                                            self._manual_probe_finalize)
     def _automatic_probe_point(self):
-        positions = []
-        for i in range(self.samples):
-            try:
-                self.gcode.run_script_from_command("PROBE")
-            except self.gcode.error as e:
-                self._finalize(False)
-                raise
-            positions.append(self.toolhead.get_position())
-            if i < self.samples - 1:
-                # retract
-                self._lift_z(self.sample_retract_dist, add=True)
-        if self.samples_result == 1:
-            # Calculate Average
-            calculated_value = [sum([pos[i] for pos in positions]) /
-                                self.samples for i in range(3)]
-        else:
-            # Calculate Median
-            sorted_z_positions = sorted([position[2]
-                                         for position in positions])
-            middle = self.samples // 2
-            if (self.samples & 1) == 1:
-                # odd number of samples
-                median = sorted_z_positions[middle]
-            else:
-                # even number of samples
-                median = (sorted_z_positions[middle] +
-                          sorted_z_positions[middle - 1]) / 2
-            calculated_value = [positions[0][0],
-                                positions[0][1],
-                                median]
+        probe = self.printer.lookup_object('probe')
+        try:
+            calculated_value = probe.run_probe(
+                self.samples, self.sample_retract_dist, self.lift_speed,
+                use_median=(self.samples_result == 0))
+        except self.gcode.error as e:
+            self._finalize(False)
+            raise
         self.results.append(calculated_value)
     def start_probe(self, params):
         # Lookup objects
@@ -7,6 +7,7 @@ import math, logging, collections
 import bus
 
 TMC_FREQUENCY=13200000.
+SPI_WRITE_TIME=0.005
 
 Registers = {
     "GCONF": 0x00, "GSTAT": 0x01, "IOIN": 0x04, "IHOLD_IRUN": 0x10,
@@ -193,10 +194,10 @@ def get_config_current(config):
                               run_current, hold_current, sense_resistor)
     return vsense, irun, ihold, sense_resistor
 
-def get_config_microsteps(config):
+def get_config_microsteps(config, config_name='microsteps'):
     steps = {'256': 0, '128': 1, '64': 2, '32': 3, '16': 4,
              '8': 5, '4': 6, '2': 7, '1': 8}
-    return config.getchoice('microsteps', steps)
+    return config.getchoice(config_name, steps)
 
 def get_config_stealthchop(config, tmc_freq):
     mres = get_config_microsteps(config)
@@ -211,6 +212,90 @@ def get_config_stealthchop(config, tmc_freq):
     return mres, True, max(0, min(0xfffff, threshold))
 
 
+######################################################################
+# Microstep resolution switching
+######################################################################
+
+# Minimum duration of a fast move that uses the coarse resolution
+SWITCH_MIN_MOVE_TIME = 0.050
+
+# Helper to reduce the step rate of fast travel moves by switching the
+# driver to a coarser microstep resolution.  The driver is only
+# reconfigured while its stepper is idle between moves.
+class MicrostepSwitch:
+    def __init__(self, config, tmc, write_time):
+        self.printer = config.get_printer()
+        self.tmc = tmc
+        self.write_time = write_time
+        self.stepper_name = " ".join(config.get_name().split()[1:])
+        self.stepper = None
+        self.mres = self.base_mres = tmc.fields.get_field("MRES")
+        self.fast_mres = get_config_microsteps(
+            config, 'high_velocity_microsteps')
+        if self.fast_mres <= self.base_mres:
+            raise config.error(
+                "high_velocity_microsteps must be less than microsteps")
+        self.velocity = config.getfloat('high_velocity_threshold', above=0.)
+        self.last_move_end = 0.
+        self.next_clock = 0
+        self.printer.register_event_handler("klippy:connect",
+                                            self._handle_connect)
+    def _handle_connect(self):
+        toolhead = self.printer.lookup_object('toolhead')
+        for s in toolhead.get_kinematics().get_steppers():
+            if s.get_name() == self.stepper_name:
+                self.stepper = s
+        if self.stepper is None:
+            raise self.printer.config_error(
+                "high_velocity_microsteps on '%s' requires a stepper"
+                " controlled by the printer kinematics" % (self.stepper_name,))
+        toolhead.register_move_callback(self._check_move)
+    def _is_idle(self, move):
+        # Check if the stepper position is constant during the move
+        if not move.is_kinematic_move:
+            return True
+        calc_pos = self.stepper.calc_position_from_coord
+        start_pos, end_pos = move.start_pos, move.end_pos
+        mid_pos = [(s + e) * .5 for s, e in zip(start_pos, end_pos)]
+        pos = calc_pos(start_pos)
+        return pos == calc_pos(end_pos) and pos == calc_pos(mid_pos)
+    def _next_is_idle(self, move):
+        # Check that the stepper idles long enough after the move to
+        # switch back to the normal resolution
+        index = move.index + 1
+        if index >= move.mq.count:
+            return False
+        next_move = move.move_queue.moves[index]
+        return (next_move.min_move_t >= 2. * self.write_time
+                and self._is_idle(next_move))
+    def _check_move(self, print_time, move):
+        if self._is_idle(move):
+            return
+        move_t = move.accel_t + move.cruise_t + move.decel_t
+        if print_time - self.last_move_end >= 2. * self.write_time:
+            # The stepper has been idle - the driver may be reconfigured
+            mres = self.base_mres
+            if (move.cruise_v >= self.velocity and not move.axes_d[3]
+                and move_t >= SWITCH_MIN_MOVE_TIME
+                and self._next_is_idle(move)):
+                mres = self.fast_mres
+            if mres != self.mres:
+                self._set_mres(print_time - self.write_time, mres)
+        self.last_move_end = print_time + move_t
+    def _set_mres(self, print_time, mres):
+        step_dist = self.stepper.get_step_dist() * 2.**(mres - self.mres)
+        self.mres = mres
+        val = self.tmc.fields.set_field("MRES", mres)
+        self.next_clock = self.tmc.schedule_register(
+            "CHOPCONF", val, print_time, self.next_clock)
+        self.stepper.set_step_distance(step_dist)
+
+def get_config_microstep_switch(config, tmc, write_time):
+    if config.get('high_velocity_microsteps', None) is None:
+        return None
+    return MicrostepSwitch(config, tmc, write_time)
+
+
 ######################################################################
 # TMC2130 printer object
 ######################################################################
@@ -265,6 +350,8 @@ class TMC2130:
         sgt = config.getint('driver_SGT', 0, minval=-64, maxval=63) & 0x7f
         self.fields.set_field("sgt", sgt)
         self._init_registers()
+        self.microstep_switch = get_config_microstep_switch(
+            config, self, SPI_WRITE_TIME)
     def _init_registers(self, min_clock = 0):
         # Send registers
         for reg_name, val in self.regs.items():
@@ -281,11 +368,21 @@ class TMC2130:
         params = self.spi.spi_transfer([reg, 0x00, 0x00, 0x00, 0x00])
         pr = bytearray(params['response'])
         return (pr[1] << 24) | (pr[2] << 16) | (pr[3] << 8) | pr[4]
-    def set_register(self, reg_name, val, min_clock = 0):
+    def _encode_write(self, reg_name, val):
         reg = Registers[reg_name]
-        data = [(reg | 0x80) & 0xff, (val >> 24) & 0xff, (val >> 16) & 0xff,
+        return [(reg | 0x80) & 0xff, (val >> 24) & 0xff, (val >> 16) & 0xff,
                 (val >> 8) & 0xff, val & 0xff]
-        self.spi.spi_send(data, min_clock)
+    def set_register(self, reg_name, val, min_clock = 0):
+        self.spi.spi_send(self._encode_write(reg_name, val), min_clock)
+    def schedule_register(self, reg_name, val, print_time, min_clock = 0):
+        # Write the register at the given time - returns the mcu clock
+        # after which the spi device is available for another scheduled
+        # write
+        mcu = self.spi.get_mcu()
+        clock = mcu.print_time_to_clock(print_time)
+        self.spi.spi_schedule_send(
+            self._encode_write(reg_name, val), clock, min_clock)
+        return mcu.print_time_to_clock(print_time + SPI_WRITE_TIME)
     def get_microsteps(self):
         return 256 >> self.fields.get_field("MRES")
     def get_phase(self):
@@ -7,6 +7,7 @@ import logging, collections
 import tmc2130
 
 TMC_FREQUENCY=12000000.
+UART_WRITE_TIME=0.012
 
 Registers = {
     "GCONF": 0x00, "GSTAT": 0x01, "IFCNT": 0x02, "SLAVECONF": 0x03,
@@ -265,7 +266,7 @@ class TMC2208:
         self.rx_pin = rx_pin_params['pin']
         self.tx_pin = tx_pin_params['pin']
         self.oid = self.mcu.create_oid()
-        self.tmcuart_send_cmd = None
+        self.tmcuart_send_cmd = self.tmcuart_schedule_send_cmd = None
         self.mcu.register_config_callback(self.build_config)
         # Add DUMP_TMC, INIT_TMC command
         gcode = self.printer.lookup_object("gcode")
@@ -313,6 +314,8 @@ class TMC2208:
         set_config_field(config, "pwm_autograd", True)
         set_config_field(config, "PWM_REG", 8)
         set_config_field(config, "PWM_LIM", 12)
+        self.microstep_switch = tmc2130.get_config_microstep_switch(
+            config, self, UART_WRITE_TIME)
     def build_config(self):
         bit_ticks = int(self.mcu.get_adjusted_freq() / 9000.)
         self.mcu.add_config_cmd(
@@ -321,6 +324,8 @@ class TMC2208:
         cmd_queue = self.mcu.alloc_command_queue()
         self.tmcuart_send_cmd = self.mcu.lookup_command(
             "tmcuart_send oid=%c write=%*s read=%c", cq=cmd_queue)
+        self.tmcuart_schedule_send_cmd = self.mcu.lookup_command(
+            "tmcuart_schedule_send oid=%c clock=%u write=%*s", cq=cmd_queue)
     def _init_registers(self):
         # Send registers
         for reg_name, val in self.regs.items():
@@ -353,6 +358,14 @@ class TMC2208:
                 return
         raise self.printer.config_error(
             "Unable to write tmc2208 '%s' register %s" % (self.name, reg_name))
+    def schedule_register(self, reg_name, val, print_time, min_clock=0):
+        # Write the register at the given time - returns the mcu clock
+        # after which the uart is available for another scheduled write
+        msg = encode_tmc2208_write(0xf5, 0x00, Registers[reg_name] | 0x80, val)
+        clock = self.mcu.print_time_to_clock(print_time)
+        self.tmcuart_schedule_send_cmd.send(
+            [self.oid, clock, msg], minclock=min_clock, reqclock=clock)
+        return self.mcu.print_time_to_clock(print_time + UART_WRITE_TIME)
     def get_microsteps(self):
         return 256 >> self.fields.get_field("MRES")
     def get_phase(self):
@@ -0,0 +1,136 @@
+# Pwm output with power proportional to the toolhead velocity
+#
+# Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import math
+import chelper, mcu
+
+# Interface to the mcu "pwm ramp" commands.  Ramps use an item in the
+# mcu move queue and are sent in order with the stepper commands.
+class MCU_pwm_ramp:
+    def __init__(self, mcu, pin_params):
+        self._mcu = mcu
+        self._oid = mcu.create_oid()
+        self._pin = pin_params['pin']
+        self._invert = pin_params['invert']
+        self._cycle_time = 0.001
+        self._max_duration = 2.
+        self._pwm_max = 0.
+        self._queue_cmd_id = None
+        self._last_value = 0.
+        ffi_main, self._ffi_lib = chelper.get_ffi()
+        self._stepqueue = ffi_main.gc(
+            self._ffi_lib.stepcompress_alloc(self._oid),
+            self._ffi_lib.stepcompress_free)
+        mcu.register_stepqueue(self._stepqueue)
+        mcu.register_config_callback(self._build_config)
+    def get_mcu(self):
+        return self._mcu
+    def setup_cycle_time(self, cycle_time):
+        self._cycle_time = cycle_time
+    def setup_max_duration(self, max_duration):
+        self._max_duration = max_duration
+    def _build_config(self):
+        self._pwm_max = self._mcu.get_constant_float("PWM_MAX")
+        self._mcu.add_config_cmd(
+            "config_pwm_ramp oid=%d pin=%s cycle_ticks=%d default_value=%d"
+            " max_duration=%d" % (
+                self._oid, self._pin,
+                self._mcu.seconds_to_clock(self._cycle_time),
+                self._invert * self._pwm_max,
+                self._mcu.seconds_to_clock(self._max_duration)))
+        self._queue_cmd_id = self._mcu.lookup_command_id(
+            "queue_pwm_ramp oid=%c clock=%u interval=%u count=%hu"
+            " value=%u add=%i")
+    def get_last_value(self):
+        return self._last_value
+    def queue_ramp(self, print_time, duration, start_value, end_value,
+                   update_time):
+        # Write 'count' evenly spaced values each sampled at the
+        # middle of its update period
+        count = min(0xffff, max(1, int(duration / update_time + .5)))
+        if start_value == end_value:
+            count = 1
+        step = (end_value - start_value) / count
+        value = start_value + .5 * step
+        if self._invert:
+            value, step = 1. - value, -step
+        scale = self._pwm_max * 65536.
+        clock = self._mcu.print_time_to_clock(print_time)
+        interval = self._mcu.seconds_to_clock(duration / count)
+        data = (self._queue_cmd_id, self._oid, clock & 0xffffffff,
+                interval, count, int(value * scale + .5),
+                int(step * scale) & 0xffffffff)
+        ret = self._ffi_lib.stepcompress_queue_move_msg(
+            self._stepqueue, clock, data, len(data))
+        if ret:
+            raise mcu.error("Internal error in stepcompress")
+        self._last_value = end_value
+        if not end_value and start_value:
+            # Don't leave the output at the last sampled value
+            self.queue_ramp(print_time + duration, 0., 0., 0., update_time)
+
+class VelocityPWM:
+    def __init__(self, config):
+        self.printer = config.get_printer()
+        ppins = self.printer.lookup_object('pins')
+        pin_params = ppins.lookup_pin(config.get('pin'), can_invert=True)
+        self.mcu_ramp = MCU_pwm_ramp(pin_params['chip'], pin_params)
+        cycle_time = config.getfloat('cycle_time', 0.001, above=0.)
+        self.mcu_ramp.setup_cycle_time(cycle_time)
+        self.update_time = config.getfloat('update_time', 0.001,
+                                           minval=cycle_time)
+        self.scale = config.getfloat('scale', 1., above=0.)
+        # Power of newly queued moves and of the moves being issued
+        self.power = self.move_power = 0.
+        # List of (move sequence, power) power changes not yet issued
+        self.power_changes = []
+        self.printer.register_event_handler("klippy:connect",
+                                            self._handle_connect)
+        name = config.get_name().split()[-1]
+        self.gcode = self.printer.lookup_object('gcode')
+        self.gcode.register_mux_command("SET_VELOCITY_PWM", "PWM", name,
+                                        self.cmd_SET_VELOCITY_PWM,
+                                        desc=self.cmd_SET_VELOCITY_PWM_help)
+    def _handle_connect(self):
+        toolhead = self.printer.lookup_object('toolhead')
+        toolhead.register_move_callback(self._queue_move)
+    def _queue_move(self, print_time, move):
+        changes = self.power_changes
+        if changes:
+            sequence = move.sequence
+            while changes and changes[0][0] <= sequence:
+                self.move_power = changes.pop(0)[1]
+        power = self.move_power
+        if not power and not self.mcu_ramp.get_last_value():
+            return
+        power_r = power / math.sqrt(move.max_cruise_v2)
+        start_p = min(power, move.start_v * power_r)
+        cruise_p = min(power, move.cruise_v * power_r)
+        end_p = min(power, move.end_v * power_r)
+        queue_ramp = self.mcu_ramp.queue_ramp
+        update_time = self.update_time
+        accel_t, cruise_t, decel_t = move.accel_t, move.cruise_t, move.decel_t
+        if accel_t:
+            queue_ramp(print_time, accel_t, start_p, cruise_p, update_time)
+            print_time += accel_t
+        if cruise_t:
+            queue_ramp(print_time, cruise_t, cruise_p, cruise_p, update_time)
+            print_time += cruise_t
+        if decel_t:
+            queue_ramp(print_time, decel_t, cruise_p, end_p, update_time)
+    cmd_SET_VELOCITY_PWM_help = "Set the power of a velocity pwm output"
+    def cmd_SET_VELOCITY_PWM(self, params):
+        power = self.gcode.get_float('POWER', params,
+                                     minval=0., maxval=self.scale)
+        power /= self.scale
+        if power == self.power:
+            return
+        # Moves already in the look-ahead queue use the prior power
+        toolhead = self.printer.lookup_object('toolhead')
+        self.power_changes.append((toolhead.get_move_sequence(), power))
+        self.power = power
+
+def load_config_prefix(config):
+    return VelocityPWM(config)
@@ -3,21 +3,374 @@
 # Copyright (C) 2018  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import os, logging
+import os, re, logging, threading, Queue, struct, zlib, json, math, bisect
+import homing
+try:
+    import zstandard
+except ImportError:
+    zstandard = None
+
+DECOMPRESS_READ_SIZE = 65536
+DECOMPRESS_QUEUE_SIZE = 8
+CHECKPOINT_INTERVAL = 4 * 1024 * 1024
+INDEX_VERSION = 2
+STREAM_POLL_TIME = 0.250
+PREHEAT_CHECK_TIME = 1.
+PREHEAT_HORIZON = 1800.
+ESTIMATE_PAUSE_MOVES = 256
+
+# Read access to a gzip/zstd compressed file (decompressed in a
+# background thread).  All positions are offsets in the uncompressed
+# data.  If no reactor is given, reads block until data is available.
+class CompressedFile:
+    def __init__(self, filename, reactor):
+        self.name = filename
+        self.reactor = reactor
+        self.is_zstd = filename.lower().endswith('.zst')
+        if self.is_zstd and zstandard is None:
+            raise IOError("zstandard module not available")
+        # Decompressor states that reading may be resumed from
+        self.checkpoints = [(0, 0, None)]
+        self.size = self._read_size()
+        self.position = 0
+        self.buffer = ""
+        self.is_eof = False
+        self.bg_queue = self.bg_thread = None
+        self.bg_stop = False
+    def _read_size(self):
+        f = open(self.name, 'rb')
+        try:
+            if self.is_zstd:
+                params = zstandard.get_frame_parameters(f.read(18))
+                size = params.content_size
+                if size < 0 or size == zstandard.CONTENTSIZE_UNKNOWN:
+                    raise IOError("zstd file does not record content size")
+                return size
+            # The gzip trailer only records the size (modulo 4GiB) of
+            # the last member, so decompress the file to find its size.
+            # Checkpoints are recorded so that later seeks are fast.
+            dobj = self._new_decompressor()
+            upos = cpos = 0
+            while 1:
+                data = f.read(DECOMPRESS_READ_SIZE)
+                if not data:
+                    break
+                cpos += len(data)
+                out, dobj = self._decompress(dobj, data)
+                upos += len(out)
+                if upos >= self.checkpoints[-1][0] + CHECKPOINT_INTERVAL:
+                    self.checkpoints.append((upos, cpos, dobj.copy()))
+                if self.reactor is not None:
+                    self.reactor.pause(self.reactor.NOW)
+            return upos
+        finally:
+            f.close()
+    def _new_decompressor(self):
+        if self.is_zstd:
+            return zstandard.ZstdDecompressor().decompressobj()
+        return zlib.decompressobj(16 + zlib.MAX_WBITS)
+    def _decompress(self, dobj, data):
+        out = dobj.decompress(data)
+        while not self.is_zstd and dobj.unused_data:
+            # Start of another gzip member
+            unused = dobj.unused_data
+            dobj = self._new_decompressor()
+            out += dobj.decompress(unused)
+        return out, dobj
+    def _bg_put(self, data):
+        while not self.bg_stop:
+            try:
+                self.bg_queue.put(data, timeout=0.100)
+                return
+            except Queue.Full:
+                pass
+    def _bg_thread(self, upos, cpos, dobj, skip_pos):
+        try:
+            f = open(self.name, 'rb')
+            f.seek(cpos)
+            while not self.bg_stop:
+                data = f.read(DECOMPRESS_READ_SIZE)
+                if not data:
+                    break
+                out, dobj = self._decompress(dobj, data)
+                if not out:
+                    continue
+                if upos + len(out) <= skip_pos:
+                    # Discard data prior to the requested position
+                    upos += len(out)
+                    continue
+                if upos < skip_pos:
+                    out = out[skip_pos - upos:]
+                    upos = skip_pos
+                upos += len(out)
+                self._bg_put(out)
+            f.close()
+        except:
+            logging.exception("virtual_sdcard decompress")
+            self._bg_put(None)
+            return
+        self._bg_put("")
+    def _stop(self):
+        if self.bg_thread is not None:
+            self.bg_stop = True
+            self.bg_thread.join()
+            self.bg_thread = self.bg_queue = None
+            self.bg_stop = False
+    def _start(self):
+        # Resume decompression from the closest prior checkpoint
+        upos, cpos, dobj = [c for c in self.checkpoints
+                            if c[0] <= self.position][-1]
+        if dobj is None:
+            dobj = self._new_decompressor()
+        else:
+            dobj = dobj.copy()
+        self.bg_queue = Queue.Queue(DECOMPRESS_QUEUE_SIZE)
+        self.bg_thread = threading.Thread(
+            target=self._bg_thread, args=(upos, cpos, dobj, self.position))
+        self.bg_thread.daemon = True
+        self.bg_thread.start()
+    def read(self, size):
+        if self.bg_thread is None and not self.is_eof:
+            self._start()
+        while len(self.buffer) < size and not self.is_eof:
+            try:
+                data = self.bg_queue.get(self.reactor is None)
+            except Queue.Empty:
+                self.reactor.pause(self.reactor.monotonic() + 0.005)
+                continue
+            if data is None:
+                raise IOError("Error decompressing file")
+            if not data:
+                self.is_eof = True
+                break
+            self.buffer += data
+        data = self.buffer[:size]
+        self.buffer = self.buffer[size:]
+        self.position += len(data)
+        return data
+    def seek(self, pos, whence=os.SEEK_SET):
+        if whence == os.SEEK_END:
+            pos += self.size
+        if pos == self.position:
+            return
+        self._stop()
+        self.position = pos
+        self.buffer = ""
+        self.is_eof = False
+    def tell(self):
+        return self.position
+    def close(self):
+        self._stop()
+
+# Pre-parsed binary gcode files.  The file starts with a header
+# containing the size of the source gcode followed by a series of
+# records (each record describes one or more lines of the source).
+BINARY_MAGIC = "KGCB"
+BINARY_VERSION = 1
+BINARY_HEADER = struct.Struct('<4sBxxxQ')
+REC_TEXT, REC_SKIP, REC_MOVE = range(3)
+TEXT_RECORD = struct.Struct('<BI')
+MOVE_RECORD = struct.Struct('<BBH')
+MOVE_AXES = 'XYZEF'
+MOVE_VALUES = [struct.Struct('<' + 'd' * bin(mask).count('1'))
+               for mask in range(1 << len(MOVE_AXES))]
+gcode_args_r = re.compile('([A-Z_]+|[A-Z*/])')
+
+# Encode a line of text gcode (same parsing rules as gcode.py)
+def encode_gcode_line(line):
+    linelen = len(line) + 1
+    text = line.strip()
+    cpos = text.find(';')
+    if cpos >= 0:
+        text = text[:cpos]
+    parts = gcode_args_r.split(text.upper())[1:]
+    if not parts:
+        return TEXT_RECORD.pack(REC_SKIP, linelen)
+    if (parts[0] == 'G' and parts[1].strip() in ('0', '1')
+        and linelen < 0x10000):
+        params = { parts[i]: parts[i+1].strip()
+                   for i in range(2, len(parts), 2) }
+        if len(params) * 2 == len(parts) - 2:
+            mask = 0
+            values = []
+            for i, axis in enumerate(MOVE_AXES):
+                if axis in params:
+                    mask |= 1 << i
+                    try:
+                        values.append(float(params.pop(axis)))
+                    except ValueError:
+                        params[axis] = None
+            if not params and (not mask & 0x10 or values[-1] > 0.):
+                return (MOVE_RECORD.pack(REC_MOVE, mask, linelen)
+                        + MOVE_VALUES[mask].pack(*values))
+    return TEXT_RECORD.pack(REC_TEXT, len(line)) + line
+
+# Convert a text gcode file to the binary format
+def convert_gcode(infile, outfile, pause=None):
+    outfile.write(BINARY_HEADER.pack(BINARY_MAGIC, BINARY_VERSION, 0))
+    source_size = skip_size = 0
+    partial_input = ""
+    while 1:
+        data = infile.read(65536)
+        if not data:
+            break
+        source_size += len(data)
+        lines = data.split('\n')
+        lines[0] = partial_input + lines[0]
+        partial_input = lines.pop()
+        out = []
+        for line in lines:
+            rec = encode_gcode_line(line)
+            if ord(rec[0]) == REC_SKIP:
+                # Merge runs of comments and blank lines
+                skip_size += len(line) + 1
+                continue
+            if skip_size:
+                out.append(TEXT_RECORD.pack(REC_SKIP, skip_size))
+                skip_size = 0
+            out.append(rec)
+        outfile.write("".join(out))
+        if pause is not None:
+            pause()
+    # Note that (like virtual_sdcard text printing) a final line
+    # without a trailing newline is not run
+    if skip_size:
+        outfile.write(TEXT_RECORD.pack(REC_SKIP, skip_size))
+    outfile.seek(0)
+    outfile.write(BINARY_HEADER.pack(BINARY_MAGIC, BINARY_VERSION,
+                                     source_size))
+
+# Read access to a binary gcode file.  Positions are offsets in the
+# source gcode.
+class BinaryGCodeFile:
+    def __init__(self, filename):
+        self.name = filename
+        self.file = open(filename, 'rb')
+        header = self.file.read(BINARY_HEADER.size)
+        if len(header) != BINARY_HEADER.size:
+            raise IOError("Invalid binary gcode file")
+        magic, version, self.size = BINARY_HEADER.unpack(header)
+        if magic != BINARY_MAGIC or version != BINARY_VERSION:
+            raise IOError("Unsupported binary gcode file")
+        self.position = 0
+        self.data = ""
+        self.pending = []
+    def _decode(self):
+        # Decode the records of the next block of the file
+        data = self.data + self.file.read(65536)
+        out = []
+        pos = 0
+        datalen = len(data)
+        while pos + TEXT_RECORD.size <= datalen:
+            rtype = ord(data[pos])
+            if rtype == REC_MOVE:
+                rtype, mask, linelen = MOVE_RECORD.unpack_from(data, pos)
+                values = MOVE_VALUES[mask]
+                end = pos + MOVE_RECORD.size + values.size
+                if end > datalen:
+                    break
+                params = { '#command': 'G1', '#original': 'G1' }
+                params.update(zip(
+                    [a for i, a in enumerate(MOVE_AXES) if mask & (1 << i)],
+                    values.unpack_from(data, pos + MOVE_RECORD.size)))
+                out.append((params, linelen))
+            else:
+                rtype, size = TEXT_RECORD.unpack_from(data, pos)
+                if rtype == REC_SKIP:
+                    end = pos + TEXT_RECORD.size
+                    out.append((None, size))
+                else:
+                    end = pos + TEXT_RECORD.size + size
+                    if end > datalen:
+                        break
+                    out.append((data[pos + TEXT_RECORD.size:end], size + 1))
+            pos = end
+        self.data = data[pos:]
+        if not out and self.data:
+            raise IOError("Truncated binary gcode file")
+        return out
+    def read_commands(self):
+        # Return a list of (command, source_size) tuples.  The command
+        # is a text line, a pre-parsed move, or None for skipped lines.
+        out = self.pending or self._decode()
+        self.pending = []
+        self.position += sum([size for cmd, size in out])
+        return out
+    def read(self, size):
+        # Return the commands in text form (for diagnostic purposes)
+        lines = []
+        while size > 0:
+            cmds = self.read_commands()
+            if not cmds:
+                break
+            for cmd, cmdsize in cmds:
+                if type(cmd) is dict:
+                    cmd = "G1 " + " ".join([
+                        "%s%.6f" % (a, cmd[a]) for a in MOVE_AXES if a in cmd])
+                elif cmd is None:
+                    cmd = ""
+                lines.append(cmd + "\n")
+                size -= cmdsize
+        return "".join(lines)
+    def seek(self, pos, whence=os.SEEK_SET):
+        # Seek to the first command starting at or after the position
+        if whence == os.SEEK_END:
+            pos += self.size
+        self.data = ""
+        self.pending = []
+        if pos >= self.size:
+            self.file.seek(0, os.SEEK_END)
+            self.position = self.size
+            return
+        self.file.seek(BINARY_HEADER.size)
+        self.position = 0
+        while self.position < pos:
+            cmds = self._decode()
+            if not cmds:
+                break
+            for i, (cmd, size) in enumerate(cmds):
+                if self.position >= pos:
+                    self.pending = cmds[i:]
+                    break
+                self.position += size
+    def tell(self):
+        return self.position
+    def close(self):
+        self.file.close()
+
+def open_gcode_file(fname, reactor=None):
+    if fname.lower().endswith('.kgc'):
+        return BinaryGCodeFile(fname)
+    if fname.lower().endswith(('.gz', '.zst')):
+        return CompressedFile(fname, reactor)
+    return open(fname, 'rb')
 
 class VirtualSD:
     def __init__(self, config):
-        printer = config.get_printer()
+        self.printer = printer = config.get_printer()
         printer.register_event_handler("klippy:shutdown", self.handle_shutdown)
         # sdcard state
         sd = config.get('path')
         self.sdcard_dirname = os.path.normpath(os.path.expanduser(sd))
+        self.stream_start_size = config.getint(
+            'stream_start_size', 1024 * 1024, minval=0)
+        self.stream_timeout = config.getfloat(
+            'stream_timeout', 5., above=0.)
+        self.preheat = config.getboolean('preheat', False)
+        self.preheat_margin = config.getfloat('preheat_margin', 10., minval=0.)
         self.current_file = None
         self.file_position = self.file_size = 0
+        self.is_binary = False
+        self.is_streaming = False
+        self.file_index = None
+        self.index_pending = False
+        self.bg_task = None
         # Work timer
         self.reactor = printer.get_reactor()
         self.must_pause_work = False
         self.work_timer = None
+        self.preheat_timer = None
+        self.preheat_done = set()
         # Register commands
         self.gcode = printer.lookup_object('gcode')
         self.gcode.register_command('M21', None)
@@ -25,9 +378,24 @@ class VirtualSD:
             self.gcode.register_command(cmd, getattr(self, 'cmd_' + cmd))
         for cmd in ['M28', 'M29', 'M30']:
             self.gcode.register_command(cmd, self.cmd_error)
+        self.gcode.register_command(
+            'SDCARD_CONVERT', self.cmd_SDCARD_CONVERT,
+            desc=self.cmd_SDCARD_CONVERT_help)
+        self.gcode.register_command(
+            'SDCARD_ESTIMATE', self.cmd_SDCARD_ESTIMATE,
+            desc=self.cmd_SDCARD_ESTIMATE_help)
+        self.gcode.register_command(
+            'SDCARD_RESUME_LAYER', self.cmd_SDCARD_RESUME_LAYER,
+            desc=self.cmd_SDCARD_RESUME_LAYER_help)
     def handle_shutdown(self):
         if self.work_timer is not None:
             self.must_pause_work = True
+            if isinstance(self.current_file, CompressedFile):
+                # The work timer may be paused within read(), so don't
+                # seek the file to log the upcoming data
+                logging.info("Virtual sdcard position: %d",
+                             self.file_position)
+                return
             try:
                 readpos = max(self.file_position - 1024, 0)
                 readcount = self.file_position - readpos
@@ -43,6 +411,8 @@ class VirtualSD:
         if self.work_timer is None:
             return False, ""
         return True, "sd_pos=%d" % (self.file_position,)
+    def _open_file(self, fname):
+        return open_gcode_file(fname, self.reactor)
     def get_file_list(self):
         dname = self.sdcard_dirname
         try:
@@ -55,11 +425,316 @@ class VirtualSD:
             raise self.gcode.error("Unable to get file list")
     def get_status(self, eventtime):
         progress = 0.
+        remaining_time = None
         if self.work_timer is not None and self.file_size:
             progress = float(self.file_position) / self.file_size
-        return {'progress': progress}
+            index = self.file_index
+            if index is not None and index['print_time']:
+                # Report progress based on the estimated print time
+                print_time = self._calc_print_time(index, self.file_position)
+                progress = print_time / index['print_time']
+                remaining_time = index['print_time'] - print_time
+        return {'progress': progress, 'remaining_time': remaining_time}
     def is_active(self):
         return self.work_timer is not None
+    # File index (layer changes, estimated print time, print area)
+    args_r = re.compile('([A-Z])\s*([-+]?[0-9]*\.?[0-9]*)')
+    def _iter_commands(self, f, pause):
+        # Generate (command, size) for each line of a file
+        if isinstance(f, BinaryGCodeFile):
+            while 1:
+                cmds = f.read_commands()
+                if not cmds:
+                    break
+                for cmd in cmds:
+                    yield cmd
+                pause()
+            return
+        partial_input = ""
+        while 1:
+            data = f.read(65536)
+            if not data:
+                break
+            lines = data.split('\n')
+            lines[0] = partial_input + lines[0]
+            partial_input = lines.pop()
+            for line in lines:
+                yield line, len(line) + 1
+            pause()
+    def _build_index(self, f, pause, planner=None):
+        # Scan a file for layer changes, the print time of each layer,
+        # heater temperature changes, and the xy area of all extruding
+        # moves.  Without a planner (see toolhead.MovePlanner) the
+        # print time is based on distance and feedrate only.
+        min_x = min_y = 99999999.9
+        max_x = max_y = -99999999.9
+        pos = [0., 0., 0., 0.]
+        if planner is not None:
+            pos = planner.get_position()
+        absolute_coord = absolute_extrude = True
+        speed = 25. * 60.
+        speed_factor = 1.
+        offset = 0
+        print_time = 0.
+        layers = []
+        layer_z = None
+        z_change = None
+        # Temperature changes and the last extrusion using each heater
+        temps = []
+        tool = 'extruder0'
+        heater_use = {}
+        plan_count = 0
+        for cmd, size in self._iter_commands(f, pause):
+            if type(cmd) is dict:
+                args = cmd
+                gcmd = '1'
+            elif cmd is None:
+                offset += size
+                continue
+            else:
+                line = cmd.split(';', 1)[0].strip().upper()
+                if line.startswith('SET_VELOCITY_LIMIT'):
+                    if planner is not None:
+                        self._index_velocity_limit(planner, line)
+                    offset += size
+                    continue
+                args = dict(self.args_r.findall(line))
+                gcmd = args.get('G')
+            if gcmd in ('0', '1'):
+                newpos = list(pos)
+                for i, axis in enumerate('XYZE'):
+                    try:
+                        v = float(args[axis])
+                    except (KeyError, ValueError):
+                        continue
+                    absolute = absolute_coord if i < 3 else absolute_extrude
+                    if not absolute:
+                        v += pos[i]
+                    newpos[i] = v
+                state = None
+                if newpos[2] != pos[2] or z_change is None:
+                    if planner is not None:
+                        print_time = planner.add_mark()
+                    state = [offset] + pos + [
+                        print_time, absolute_coord, absolute_extrude, speed]
+                    if newpos[2] != pos[2]:
+                        z_change = state
+                try:
+                    if float(args['F']) > 0.:
+                        speed = float(args['F'])
+                except (KeyError, ValueError):
+                    pass
+                if planner is not None:
+                    planner.move(newpos, speed * speed_factor / 60.)
+                    plan_count += 1
+                    if not plan_count % ESTIMATE_PAUSE_MOVES:
+                        pause()
+                else:
+                    move_d = math.sqrt(sum([(newpos[i] - pos[i])**2
+                                            for i in range(3)]))
+                    print_time += ((move_d or abs(newpos[3] - pos[3]))
+                                   * 60. / (speed * speed_factor))
+                if newpos[3] > pos[3] and newpos[:2] != pos[:2]:
+                    # Extruding move
+                    heater_use[tool] = heater_use['heater_bed'] = offset
+                    min_x = min(min_x, pos[0], newpos[0])
+                    max_x = max(max_x, pos[0], newpos[0])
+                    min_y = min(min_y, pos[1], newpos[1])
+                    max_y = max(max_y, pos[1], newpos[1])
+                    if newpos[2] != layer_z:
+                        # New layer - starts at the line that set this z
+                        layer_z = newpos[2]
+                        if z_change is None or z_change[0] == offset:
+                            z_change = state
+                        layers.append([z_change[0], layer_z] + z_change[1:])
+                pos = newpos
+            elif gcmd == '4':
+                try:
+                    if 'S' in args:
+                        delay = float(args['S'])
+                    else:
+                        delay = float(args['P']) / 1000.
+                except (KeyError, ValueError):
+                    delay = 0.
+                if planner is not None:
+                    planner.dwell(delay)
+                else:
+                    print_time += delay
+            elif gcmd == '90':
+                absolute_coord = absolute_extrude = True
+            elif gcmd == '91':
+                absolute_coord = absolute_extrude = False
+            elif gcmd == '92':
+                for i, axis in enumerate('XYZE'):
+                    try:
+                        pos[i] = float(args[axis])
+                    except (KeyError, ValueError):
+                        pass
+                if planner is not None:
+                    planner.set_position(pos)
+            elif gcmd is None:
+                mcmd = args.get('M')
+                if mcmd in ('104', '109', '140', '190'):
+                    if mcmd in ('140', '190'):
+                        heater = 'heater_bed'
+                    elif 'T' in args:
+                        heater = 'extruder' + args['T']
+                    else:
+                        heater = tool
+                    try:
+                        target = float(args.get('S', 0.))
+                    except ValueError:
+                        target = 0.
+                    if planner is not None:
+                        print_time = planner.add_mark()
+                    temps.append([offset, heater, target, print_time,
+                                  heater_use.get(heater, -1)])
+                elif mcmd is None and args.get('T', '').isdigit():
+                    tool = 'extruder' + args['T']
+                elif mcmd == '82':
+                    absolute_extrude = True
+                elif mcmd == '83':
+                    absolute_extrude = False
+                elif mcmd == '220':
+                    try:
+                        speed_factor = max(float(args['S']) / 100., .01)
+                    except (KeyError, ValueError):
+                        pass
+                elif mcmd == '204' and planner is not None:
+                    try:
+                        if 'S' in args:
+                            accel = float(args['S'])
+                        else:
+                            accel = min(float(args['P']), float(args['T']))
+                    except (KeyError, ValueError):
+                        accel = 0.
+                    if accel > 0.:
+                        planner.set_velocity_limit(max_accel=accel)
+            offset += size
+        if planner is not None:
+            for layer in layers:
+                layer[6] = planner.get_mark_time(layer[6])
+            for temp in temps:
+                temp[3] = planner.get_mark_time(temp[3])
+            print_time = planner.get_print_time()
+        area = None
+        if min_x <= max_x:
+            area = [min_x, min_y, max_x, max_y]
+        return {'layers': layers, 'temps': temps, 'area': area,
+                'size': offset, 'print_time': print_time}
+    def _index_velocity_limit(self, planner, line):
+        limits = {}
+        for param in line.split()[1:]:
+            key, sep, value = param.partition('=')
+            try:
+                if float(value) > 0.:
+                    limits[key] = float(value)
+            except ValueError:
+                pass
+        planner.set_velocity_limit(
+            limits.get('VELOCITY'), limits.get('ACCEL'),
+            limits.get('SQUARE_CORNER_VELOCITY'),
+            limits.get('ACCEL_TO_DECEL'))
+    def _index_filename(self, fname):
+        dname, bname = os.path.split(fname)
+        return os.path.join(dname, '.' + bname + '.index')
+    def _load_index(self, fname):
+        try:
+            f = open(self._index_filename(fname), 'rb')
+            index = json.load(f)
+            f.close()
+        except:
+            return None
+        if (index.get('version') != INDEX_VERSION
+            or index.get('mtime') != os.path.getmtime(fname)):
+            return None
+        return index
+    def _save_index(self, fname, index):
+        try:
+            f = open(self._index_filename(fname), 'wb')
+            json.dump(index, f)
+            f.close()
+        except:
+            logging.exception("virtual_sdcard index write")
+    def _create_index(self, fname):
+        mtime = os.path.getmtime(fname)
+        f = self._open_file(fname)
+        try:
+            index = self._build_index(f, lambda: self.reactor.pause(
+                self.reactor.NOW))
+        finally:
+            f.close()
+        index['version'] = INDEX_VERSION
+        index['mtime'] = mtime
+        index['planned'] = False
+        prev_index = self._load_index(fname)
+        if prev_index is not None:
+            # SDCARD_ESTIMATE completed while this index was built
+            return prev_index
+        self._save_index(fname, index)
+        logging.info("virtual_sdcard indexed %s: %d layers", fname,
+                     len(index['layers']))
+        return index
+    def _index_handler(self, eventtime):
+        # Build the index of the selected file in the background
+        fname = self.current_file.name
+        try:
+            index = self._create_index(fname)
+        except:
+            logging.exception("virtual_sdcard index")
+            index = None
+        if (self.index_pending and self.current_file is not None
+            and self.current_file.name == fname):
+            self.file_index = index
+            self.index_pending = False
+    def _start_index(self):
+        if self.is_streaming:
+            # The file is not complete yet
+            self.file_index = None
+            self.index_pending = False
+            return
+        fname = self.current_file.name
+        self.file_index = self._load_index(fname)
+        self.index_pending = self.file_index is None
+        if self.index_pending:
+            self.reactor.register_callback(self._index_handler)
+    def get_index(self):
+        # Return the index of the selected file (waiting if necessary)
+        while self.index_pending:
+            self.reactor.pause(self.reactor.monotonic() + 0.100)
+        return self.file_index
+    def get_layers(self):
+        # Return a list of (offset, z, x, y, start_z, e, print_time,
+        # absolute_coord, absolute_extrude, speed) for each layer
+        index = self.get_index()
+        if index is None:
+            return []
+        return index['layers']
+    def get_print_area(self):
+        # Return the xy area extruded by the currently selected file
+        if self.current_file is None:
+            return None
+        index = self.get_index()
+        if index is None or index['area'] is None:
+            return None
+        return tuple(index['area'])
+    def _calc_print_time(self, index, offset):
+        # Estimate the print time up to the given file offset
+        layers = index['layers']
+        i = bisect.bisect_right([l[0] for l in layers], offset) - 1
+        if i < 0:
+            start_offset, start_time = 0, 0.
+        else:
+            start_offset, start_time = layers[i][0], layers[i][6]
+        if i + 1 < len(layers):
+            end_offset, end_time = layers[i+1][0], layers[i+1][6]
+        else:
+            end_offset, end_time = index['size'], index['print_time']
+        if end_offset <= start_offset:
+            return start_time
+        r = float(min(offset, end_offset) - start_offset) / (
+            end_offset - start_offset)
+        return start_time + r * (end_time - start_time)
     def do_pause(self):
         if self.work_timer is not None:
             self.must_pause_work = True
@@ -84,6 +759,8 @@ class VirtualSD:
             self.current_file.close()
             self.current_file = None
             self.file_position = self.file_size = 0
+            self.file_index = None
+            self.index_pending = False
         try:
             orig = params['#original']
             filename = orig[orig.find("M23") + 4:].split()[0].strip()
@@ -91,25 +768,161 @@ class VirtualSD:
                 filename = filename[:filename.find('*')].strip()
         except:
             raise self.gcode.error("Unable to extract filename")
-        if filename.startswith('/'):
-            filename = filename[1:]
-        files = self.get_file_list()
-        files_by_lower = { fname.lower(): fname for fname, fsize in files }
         try:
-            fname = files_by_lower[filename.lower()]
-            fname = os.path.join(self.sdcard_dirname, fname)
-            f = open(fname, 'rb')
+            fname = self._lookup_file(filename)
+            is_streaming = fname.lower().endswith('.part')
+            if is_streaming and fname[:-5].lower().endswith(
+                    ('.gz', '.zst', '.kgc')):
+                raise self.gcode.error(
+                    "Only plain g-code files may be printed while uploading")
+            f = self._open_file(fname)
             f.seek(0, os.SEEK_END)
             fsize = f.tell()
             f.seek(0)
+        except self.gcode.error:
+            raise
         except:
             logging.exception("virtual_sdcard file open")
             raise self.gcode.error("Unable to open file")
         self.gcode.respond("File opened:%s Size:%d" % (filename, fsize))
         self.gcode.respond("File selected")
         self.current_file = f
+        self.is_binary = isinstance(f, BinaryGCodeFile)
+        self.is_streaming = is_streaming
+        self.preheat_done.clear()
         self.file_position = 0
         self.file_size = fsize
+        self._start_index()
+    def _lookup_file(self, filename):
+        if filename.startswith('/'):
+            filename = filename[1:]
+        files = self.get_file_list()
+        files_by_lower = { fname.lower(): fname for fname, fsize in files }
+        return os.path.join(self.sdcard_dirname,
+                            files_by_lower[filename.lower()])
+    def _start_task(self, name, func):
+        # Run a long task from a reactor callback (so that g-code
+        # processing, and thus printing, is not blocked) and report
+        # any error once it completes
+        if self.bg_task is not None:
+            raise self.gcode.error("%s already in progress" % (self.bg_task,))
+        self.bg_task = name
+        def task_handler(eventtime):
+            try:
+                func()
+            except self.gcode.error as e:
+                self.gcode.respond_error(str(e))
+            except:
+                logging.exception("virtual_sdcard %s", name)
+                self.gcode.respond_error("Internal error in %s" % (name,))
+            self.bg_task = None
+        self.reactor.register_callback(task_handler)
+    cmd_SDCARD_CONVERT_help = "Convert a gcode file to pre-parsed binary form"
+    def cmd_SDCARD_CONVERT(self, params):
+        filename = self.gcode.get_str('FILENAME', params)
+        try:
+            fname = self._lookup_file(filename)
+        except KeyError:
+            raise self.gcode.error("Unknown file '%s'" % (filename,))
+        if fname.lower().endswith('.kgc'):
+            raise self.gcode.error("File is already in binary form")
+        self._start_task('SDCARD_CONVERT', lambda: self._convert_file(fname))
+    def _convert_file(self, fname):
+        outname = os.path.join(self.sdcard_dirname, os.path.splitext(
+            os.path.basename(fname))[0] + '.kgc')
+        tmpname = os.path.join(self.sdcard_dirname,
+                               '.' + os.path.basename(outname) + '.tmp')
+        try:
+            infile = self._open_file(fname)
+            outfile = open(tmpname, 'wb')
+            try:
+                convert_gcode(infile, outfile, lambda: self.reactor.pause(
+                    self.reactor.NOW))
+            finally:
+                infile.close()
+                outfile.close()
+            os.rename(tmpname, outname)
+        except:
+            logging.exception("virtual_sdcard convert")
+            raise self.gcode.error("Unable to convert file")
+        self.gcode.respond_info("Created %s" % (os.path.basename(outname),))
+    def _estimate_file(self, fname):
+        # Plan the moves of a file (pausing regularly so that printing
+        # is not delayed)
+        planner = self.printer.lookup_object('toolhead').get_planner()
+        f = self._open_file(fname)
+        try:
+            return self._build_index(f, lambda: self.reactor.pause(
+                self.reactor.NOW), planner)
+        except homing.EndstopError as e:
+            raise self.gcode.error(str(e))
+        finally:
+            f.close()
+    cmd_SDCARD_ESTIMATE_help = "Estimate the time needed to print a file"
+    def cmd_SDCARD_ESTIMATE(self, params):
+        if 'FILENAME' in params:
+            filename = self.gcode.get_str('FILENAME', params)
+            try:
+                fname = self._lookup_file(filename)
+            except KeyError:
+                raise self.gcode.error("Unknown file '%s'" % (filename,))
+        elif self.current_file is not None:
+            fname = self.current_file.name
+        else:
+            raise self.gcode.error("No file selected")
+        self._start_task('SDCARD_ESTIMATE',
+                         lambda: self._update_estimate(fname))
+    def _update_estimate(self, fname):
+        mtime = os.path.getmtime(fname)
+        start_time = self.reactor.monotonic()
+        index = self._estimate_file(fname)
+        index['version'] = INDEX_VERSION
+        index['mtime'] = mtime
+        index['planned'] = True
+        self._save_index(fname, index)
+        if self.current_file is not None and self.current_file.name == fname:
+            self.file_index = index
+            self.index_pending = False
+        total = index['print_time']
+        self.gcode.respond_info(
+            "Estimated print time of %s: %dh %02dm %02ds (%d layers)\n"
+            "Estimate took %.1fs" % (
+                os.path.basename(fname), total // 3600, total // 60 % 60,
+                total % 60, len(index['layers']),
+                self.reactor.monotonic() - start_time))
+    cmd_SDCARD_RESUME_LAYER_help = "Position the toolhead to print from a layer"
+    def cmd_SDCARD_RESUME_LAYER(self, params):
+        if self.work_timer is not None:
+            raise self.gcode.error("SD busy")
+        if self.current_file is None:
+            raise self.gcode.error("No file selected")
+        layers = self.get_layers()
+        if not layers:
+            raise self.gcode.error("No layers found in file")
+        if 'Z' in params:
+            z = self.gcode.get_float('Z', params)
+            layer = [l for l in layers if l[1] >= z - .0001]
+            if not layer:
+                raise self.gcode.error("No layer at or above z=%.3f" % (z,))
+            layer = layer[0]
+        else:
+            layer = layers[self.gcode.get_int(
+                'LAYER', params, minval=1, maxval=len(layers)) - 1]
+        lift = self.gcode.get_float('LIFT', params, 2., minval=0.)
+        speed = self.gcode.get_float('SPEED', params, 50., above=0.) * 60.
+        (offset, z, x, y, start_z, e, print_time,
+         absolute_coord, absolute_extrude, feedrate) = layer
+        # Move to the position the file had at the start of the layer
+        self.gcode.run_script_from_command(
+            "G90\nG92 E%.5f\nG1 Z%.3f F%.1f\nG1 X%.3f Y%.3f\nG1 Z%.3f\n"
+            "%s\n%s\nG1 F%.1f" % (
+                e, max(z, start_z) + lift, speed, x, y, start_z,
+                ["G91", "G90"][absolute_coord],
+                ["M83", "M82"][absolute_extrude], feedrate))
+        self.file_position = offset
+        self.gcode.respond_info(
+            "Resuming at layer %d (z=%.3f) file position %d" % (
+                layers.index(layer) + 1, z, offset))
     def cmd_M24(self, params):
         # Start/resume SD print
         if self.work_timer is not None:
@@ -117,6 +930,9 @@ class VirtualSD:
         self.must_pause_work = False
         self.work_timer = self.reactor.register_timer(
             self.work_handler, self.reactor.NOW)
+        if self.preheat and self.preheat_timer is None:
+            self.preheat_timer = self.reactor.register_timer(
+                self.preheat_handler, self.reactor.NOW)
     def cmd_M25(self, params):
         # Pause SD print
         self.do_pause()
@@ -133,10 +949,127 @@ class VirtualSD:
             return
         self.gcode.respond("SD printing byte %d/%d" % (
             self.file_position, self.file_size))
+    # Printing of files that are still being uploaded.  The uploader
+    # writes to "<name>.part" and renames it to "<name>" when complete.
+    def _is_upload_complete(self):
+        fname = self.current_file.name
+        return not os.path.exists(fname) and os.path.exists(fname[:-5])
+    def _wait_stream_start(self):
+        # Wait for the start of an uploading file to arrive
+        f = self.current_file
+        eventtime = self.reactor.monotonic()
+        did_report = False
+        while not self.must_pause_work:
+            self.file_size = os.fstat(f.fileno()).st_size
+            if (self.file_size >= self.stream_start_size
+                or self._is_upload_complete()):
+                return True
+            if not did_report:
+                did_report = True
+                self.gcode.respond_info("Waiting for upload of %s" % (
+                    os.path.basename(f.name),))
+            eventtime = self.reactor.pause(eventtime + STREAM_POLL_TIME)
+        return False
+    def _read_stream(self):
+        # Wait for more data from an uploading file.  Returns None if
+        # the print should stop.
+        f = self.current_file
+        toolhead = self.printer.lookup_object('toolhead')
+        eventtime = self.reactor.monotonic()
+        idle_time = None
+        while not self.must_pause_work:
+            is_complete = self._is_upload_complete()
+            f.seek(f.tell())
+            data = f.read(65536)
+            self.file_size = os.fstat(f.fileno()).st_size
+            if is_complete:
+                logging.info("virtual_sdcard upload of %s complete", f.name)
+                self.is_streaming = False
+            if data or is_complete:
+                return data
+            # Check if all buffered moves have completed
+            print_time, est_print_time, lookahead_empty = toolhead.check_busy(
+                eventtime)
+            if print_time > est_print_time or not lookahead_empty:
+                idle_time = None
+            elif idle_time is None:
+                idle_time = eventtime
+            elif eventtime > idle_time + self.stream_timeout:
+                self.gcode.respond_error(
+                    "Upload of %s stalled at byte %d - print paused" % (
+                        os.path.basename(f.name), self.file_size))
+                return None
+            eventtime = self.reactor.pause(eventtime + STREAM_POLL_TIME)
+        return None
+    # Predictive preheating - start heating for an upcoming temperature
+    # change early if the heater isn't used before that change
+    def _lookup_heater(self, name):
+        if name == 'heater_bed':
+            return self.printer.lookup_object('heater_bed', None)
+        extruder = self.printer.lookup_object(name, None)
+        if extruder is None:
+            return None
+        return extruder.get_heater()
+    def preheat_handler(self, eventtime):
+        index = self.file_index
+        if index is None or not index['temps']:
+            return eventtime + PREHEAT_CHECK_TIME
+        pos = self.file_position
+        cur_time = self._calc_print_time(index, pos)
+        temps = index['temps']
+        i = bisect.bisect_right([temp[0] for temp in temps], pos)
+        seen = set()
+        for offset, name, target, print_time, last_use in temps[i:]:
+            if print_time - cur_time > PREHEAT_HORIZON:
+                break
+            if name in seen:
+                continue
+            # Only the next temperature change of each heater is checked
+            seen.add(name)
+            if offset in self.preheat_done or last_use >= pos:
+                continue
+            heater = self._lookup_heater(name)
+            if heater is None:
+                continue
+            cur_temp, cur_target = heater.get_temp(eventtime)
+            if target <= cur_target:
+                continue
+            heat_time = heater.get_heat_time(target)
+            if print_time - cur_time > heat_time + self.preheat_margin:
+                continue
+            toolhead = self.printer.lookup_object('toolhead')
+            try:
+                heater.set_temp(toolhead.check_busy(eventtime)[0], target)
+            except heater.error as e:
+                logging.info("virtual_sdcard preheat: %s", str(e))
+            self.preheat_done.add(offset)
+            self.gcode.respond_info(
+                "Preheating %s to %.0f (needed in about %.0fs)" % (
+                    name, target, print_time - cur_time))
+        return eventtime + PREHEAT_CHECK_TIME
     # Background work timer
+    def _batch_lines(self, lines):
+        # Generate lines for the gcode engine until it has other input
+        # pending (the file position is advanced as each line completes)
+        gcode = self.gcode
+        while lines and not self.must_pause_work:
+            line = lines[-1]
+            if type(line) is tuple:
+                # Command from a binary gcode file
+                if line[0] is not None:
+                    yield line[0]
+                self.file_position += lines.pop()[1]
+            else:
+                yield line
+                self.file_position += len(lines.pop()) + 1
+            if gcode.has_pending_commands():
+                break
     def work_handler(self, eventtime):
         logging.info("Starting SD card print (position %d)", self.file_position)
         self.reactor.unregister_timer(self.work_timer)
+        if self.is_streaming and not self._wait_stream_start():
+            self.work_timer = None
+            return self.reactor.NEVER
         try:
             self.current_file.seek(self.file_position)
         except:
@@ -150,7 +1083,14 @@ class VirtualSD:
             if not lines:
                 # Read more data
                 try:
-                    data = self.current_file.read(8192)
+                    if self.is_binary:
+                        data = self.current_file.read_commands()
+                    else:
+                        data = self.current_file.read(65536)
+                        if not data and self.is_streaming:
+                            data = self._read_stream()
+                            if data is None:
+                                break
                 except:
                     logging.exception("virtual_sdcard read")
                     self.gcode.respond_error("Error on virtual sdcard read")
@@ -159,18 +1099,23 @@ class VirtualSD:
                     # End of file
                     self.current_file.close()
                     self.current_file = None
+                    self.file_index = None
+                    self.index_pending = False
                     logging.info("Finished SD card print")
                     self.gcode.respond("Done printing file")
                     break
-                lines = data.split('\n')
-                lines[0] = partial_input + lines[0]
-                partial_input = lines.pop()
+                if self.is_binary:
+                    lines = data
+                else:
+                    lines = data.split('\n')
+                    lines[0] = partial_input + lines[0]
+                    partial_input = lines.pop()
                 lines.reverse()
                 self.reactor.pause(self.reactor.NOW)
                 continue
-            # Dispatch command
+            # Dispatch commands
             try:
-                res = self.gcode.process_batch([lines[-1]])
+                res = self.gcode.process_batch(self._batch_lines(lines))
                 if not res:
                     self.reactor.pause(self.reactor.monotonic() + 0.100)
                     continue
@@ -179,9 +1124,11 @@ class VirtualSD:
             except:
                 logging.exception("virtual_sdcard dispatch")
                 break
-            self.file_position += len(lines.pop()) + 1
         logging.info("Exiting SD card print (position %d)", self.file_position)
         self.work_timer = None
+        if self.preheat_timer is not None:
+            self.reactor.unregister_timer(self.preheat_timer)
+            self.preheat_timer = None
         return self.reactor.NEVER
 
 def load_config(config):
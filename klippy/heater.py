@@ -3,7 +3,7 @@
 # Copyright (C) 2016-2018  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import logging, threading
+import math, logging, threading
 
 
 ######################################################################
@@ -14,6 +14,9 @@ KELVIN_TO_CELCIUS = -273.15
 MAX_HEAT_TIME = 5.0
 AMBIENT_TEMP = 25.
 PID_PARAM_BASE = 255.
+DEFAULT_HEAT_RATE = 1.
+HEAT_RATE_MIN_TIME = 5.
+HEAT_RATE_MIN_RISE = 10.
 
 class error(Exception):
     pass
@@ -44,6 +47,16 @@ class Heater:
         self.lock = threading.Lock()
         self.last_temp = self.smoothed_temp = self.target_temp = 0.
         self.last_temp_time = 0.
+        # Heating rate model (learned from heat-ups at full power)
+        self.heat_rate = DEFAULT_HEAT_RATE
+        self.heat_rate_samples = 0
+        self.heat_start = self.heat_last = None
+        self.model = None
+        model_gain = config.getfloat('model_gain', None, above=0.)
+        if model_gain is not None:
+            self.model = (
+                model_gain, config.getfloat('model_time_constant', above=0.),
+                config.getfloat('model_dead_time', 0., minval=0.))
         # pwm caching
         self.next_pwm_time = 0.
         self.last_pwm_value = 0.
@@ -93,8 +106,51 @@ class Heater:
             adj_time = min(time_diff * self.inv_smooth_time, 1.)
             self.smoothed_temp += temp_diff * adj_time
             self.can_extrude = (self.smoothed_temp >= self.min_extrude_temp)
+            self._update_heat_rate(read_time, self.smoothed_temp)
         #logging.debug("temp: %.3f %f = %f", read_time, temp)
+    def _update_heat_rate(self, read_time, temp):
+        # Track periods where the heater runs at full power and use the
+        # average rate of temperature rise to estimate future heat-ups
+        if (self.last_pwm_value >= self.max_power - .05
+            and temp < self.target_temp - HEAT_RATE_MIN_RISE * .5):
+            if self.heat_start is None:
+                self.heat_start = (read_time, temp)
+            self.heat_last = (read_time, temp)
+            return
+        if self.heat_start is None:
+            return
+        start_time, start_temp = self.heat_start
+        last_time, last_temp = self.heat_last
+        self.heat_start = self.heat_last = None
+        if (last_time - start_time < HEAT_RATE_MIN_TIME
+            or last_temp - start_temp < HEAT_RATE_MIN_RISE):
+            return
+        rate = (last_temp - start_temp) / (last_time - start_time)
+        if not self.heat_rate_samples:
+            self.heat_rate = rate
+        else:
+            self.heat_rate = .5 * (self.heat_rate + rate)
+        self.heat_rate_samples += 1
+        logging.info("%s: heat rate %.3f (measured %.3f)",
+                     self.name, self.heat_rate, rate)
     # External commands
+    def set_model(self, gain, time_constant, dead_time):
+        with self.lock:
+            self.model = (gain, time_constant, dead_time)
+    def get_heat_time(self, degrees):
+        # Estimate the time needed to heat to the given temperature
+        with self.lock:
+            temp = self.smoothed_temp
+            if degrees <= temp:
+                return 0.
+            if self.model is None:
+                return (degrees - temp) / self.heat_rate
+            gain, time_constant, dead_time = self.model
+            final_temp = AMBIENT_TEMP + gain * self.max_power
+            if degrees >= final_temp:
+                return (degrees - temp) / self.heat_rate
+            return dead_time + time_constant * math.log(
+                (final_temp - temp) / (final_temp - degrees))
     def get_pwm_delay(self):
         return self.pwm_delay
     def get_max_power(self):
@@ -9,6 +9,7 @@ HOMING_STEP_DELAY = 0.00000025
 HOMING_START_DELAY = 0.001
 ENDSTOP_SAMPLE_TIME = .000015
 ENDSTOP_SAMPLE_COUNT = 4
+HOMING_PROGRAM_DELAY = 0.010
 
 class Homing:
     def __init__(self, printer):
@@ -31,16 +32,49 @@ class Homing:
         return thcoord
     def set_homed_position(self, pos):
         self.toolhead.set_position(self._fill_coord(pos))
-    def _get_homing_speed(self, speed, endstops):
+    def _calc_stepper_rate(self, stepper, startpos, movepos):
+        # Determine the stepper distance per toolhead distance of a move
+        move_d = math.sqrt(sum([(mp - sp)**2 for sp, mp in zip(
+            startpos[:3], movepos[:3])]))
+        if not move_d:
+            return 0.
+        return abs(stepper.calc_position_from_coord(movepos)
+                   - stepper.calc_position_from_coord(startpos)) / move_d
+    def _get_homing_speed(self, speed, endstops, startpos, movepos):
         # Round the requested homing speed so that it is an even
         # number of ticks per step.
         mcu_stepper = endstops[0][0].get_steppers()[0]
+        rate = self._calc_stepper_rate(mcu_stepper, startpos, movepos) or 1.
         adjusted_freq = mcu_stepper.get_mcu().get_adjusted_freq()
         dist_ticks = adjusted_freq * mcu_stepper.get_step_dist()
-        ticks_per_step = math.ceil(dist_ticks / speed)
-        return dist_ticks / ticks_per_step
+        ticks_per_step = math.ceil(dist_ticks / (speed * rate))
+        return dist_ticks / ticks_per_step / rate
+    def _calc_programs(self, endstops, startpos, movepos, retract_r,
+                       speed, second_speed):
+        # Determine the mcu retract and second approach for each endstop
+        move_d = math.sqrt(sum([(mp - sp)**2 for sp, mp in zip(
+            startpos[:3], movepos[:3])]))
+        programs = []
+        for mcu_endstop, name in endstops:
+            steppers = mcu_endstop.get_steppers()
+            if not hasattr(mcu_endstop, 'home_program') or not steppers:
+                return None
+            step_dist = steppers[0].get_step_dist()
+            rate = self._calc_stepper_rate(steppers[0], startpos, movepos)
+            for s in steppers:
+                if (s.get_step_dist() != step_dist or abs(
+                        self._calc_stepper_rate(s, startpos, movepos)
+                        - rate) > .000001):
+                    return None
+            retract_count = int(retract_r * move_d * rate / step_dist + .5)
+            if not rate or not retract_count or retract_count >= 0x8000:
+                return None
+            programs.append((step_dist / (speed * rate), retract_count,
+                             step_dist / (second_speed * rate),
+                             2 * retract_count))
+        return programs
     def homing_move(self, movepos, endstops, speed, dwell_t=0.,
-                    probe_pos=False, verify_movement=False):
+                    probe_pos=False, verify_movement=False, programs=None):
         # Notify endstops of upcoming home
         for mcu_endstop, name in endstops:
             mcu_endstop.home_prepare()
@@ -50,12 +84,22 @@ class Homing:
         print_time = self.toolhead.get_last_move_time()
         start_mcu_pos = [(s, name, s.get_mcu_position())
                          for es, name in endstops for s in es.get_steppers()]
-        for mcu_endstop, name in endstops:
-            min_step_dist = min([s.get_step_dist()
-                                 for s in mcu_endstop.get_steppers()])
+        startpos = self.toolhead.get_position()
+        program_time = 0.
+        for i, (mcu_endstop, name) in enumerate(endstops):
+            steppers = mcu_endstop.get_steppers()
+            min_step_dist = min([s.get_step_dist() for s in steppers])
+            rate = max([self._calc_stepper_rate(s, startpos, movepos)
+                        for s in steppers]) or 1.
             mcu_endstop.home_start(
                 print_time, ENDSTOP_SAMPLE_TIME, ENDSTOP_SAMPLE_COUNT,
-                min_step_dist / speed)
+                min_step_dist / (speed * rate))
+            if programs is not None:
+                r_time, r_count, a_time, a_count = programs[i]
+                mcu_endstop.home_program(print_time, HOMING_PROGRAM_DELAY,
+                                         r_time, r_count, a_time, a_count)
+                program_time = max(program_time, HOMING_PROGRAM_DELAY
+                                   + r_time * r_count + a_time * a_count)
         self.toolhead.dwell(HOMING_START_DELAY, check_stall=False)
         # Issue move
         error = None
@@ -68,7 +112,7 @@ class Homing:
         self.toolhead.reset_print_time(print_time)
         for mcu_endstop, name in endstops:
             try:
-                mcu_endstop.home_wait(move_end_print_time)
+                mcu_endstop.home_wait(move_end_print_time + program_time)
             except mcu_endstop.TimeoutError as e:
                 if error is None:
                     error = "Failed to home %s: %s" % (name, str(e))
@@ -99,28 +143,46 @@ class Homing:
         forcepos = self._fill_coord(forcepos)
         movepos = self._fill_coord(movepos)
         self.toolhead.set_position(forcepos, homing_axes=homing_axes)
-        # Determine homing speed
+        # Determine homing speed (so that no rail exceeds its own
+        # homing speed when several rails are homed together)
         endstops = [es for rail in rails for es in rail.get_endstops()]
-        hi = rails[0].get_homing_info()
+        axes_d = [mp - fp for mp, fp in zip(movepos, forcepos)]
+        move_d = math.sqrt(sum([d*d for d in axes_d[:3]]))
         max_velocity = self.toolhead.get_max_velocity()[0]
         if limit_speed is not None and limit_speed < max_velocity:
             max_velocity = limit_speed
-        homing_speed = min(hi.speed, max_velocity)
-        homing_speed = self._get_homing_speed(homing_speed, endstops)
-        second_homing_speed = min(hi.second_homing_speed, max_velocity)
+        homing_speed = second_homing_speed = max_velocity
+        retract_r = 0.
+        mcu_homing = True
+        for rail in rails:
+            hi = rail.get_homing_info()
+            rate = self._calc_stepper_rate(
+                rail.get_steppers()[0], forcepos, movepos) or 1.
+            homing_speed = min(homing_speed, hi.speed / rate)
+            second_homing_speed = min(second_homing_speed,
+                                      hi.second_homing_speed / rate)
+            retract_r = max(retract_r, hi.retract_dist / (rate * move_d))
+            mcu_homing = mcu_homing and hi.mcu_homing
+        homing_speed = self._get_homing_speed(
+            homing_speed, endstops, forcepos, movepos)
         # Calculate a CPU delay when homing a large axis
-        axes_d = [mp - fp for mp, fp in zip(movepos, forcepos)]
         est_move_d = abs(axes_d[0]) + abs(axes_d[1]) + abs(axes_d[2])
         est_steps = sum([est_move_d / s.get_step_dist()
                          for es, n in endstops for s in es.get_steppers()])
         dwell_t = est_steps * HOMING_STEP_DELAY
+        # Check if the mcu can perform the retract and second home
+        programs = None
+        if mcu_homing and retract_r:
+            programs = self._calc_programs(
+                endstops, forcepos, movepos, min(1., retract_r),
+                homing_speed, second_homing_speed)
         # Perform first home
-        self.homing_move(movepos, endstops, homing_speed, dwell_t=dwell_t)
+        self.homing_move(movepos, endstops, homing_speed, dwell_t=dwell_t,
+                         programs=programs)
         # Perform second home
-        if hi.retract_dist:
+        if retract_r and programs is None:
             # Retract
-            move_d = math.sqrt(sum([d*d for d in axes_d[:3]]))
-            retract_r = min(1., hi.retract_dist / move_d)
+            retract_r = min(1., retract_r)
             retractpos = [mp - ad * retract_r
                           for mp, ad in zip(movepos, axes_d)]
             self.toolhead.move(retractpos, homing_speed)
@@ -20,6 +20,7 @@ class CartKinematics:
             'max_z_velocity', max_velocity, above=0., maxval=max_velocity)
         self.max_z_accel = config.getfloat(
             'max_z_accel', max_accel, above=0., maxval=max_accel)
+        self.concurrent_homing = config.getboolean('concurrent_homing', False)
         self.need_motor_enable = True
         self.limits = [(1.0, -1.0)] * 3
         # Setup stepper max halt velocity
@@ -50,39 +51,57 @@ class CartKinematics:
     def calc_position(self):
         return [rail.get_commanded_position() for rail in self.rails]
     def set_position(self, newpos, homing_axes):
-        for i, rail in enumerate(self.rails):
+        for rail in self.rails:
             rail.set_position(newpos)
-            if i in homing_axes:
-                self.limits[i] = rail.get_range()
-    def _home_axis(self, homing_state, axis, rail):
+        self.set_homed_axes(homing_axes)
+    def set_homed_axes(self, homing_axes):
+        # Enable moves on the given axes without changing the steppers
+        # (a new list is used as the limits may be shared with a copy
+        # of this object - see toolhead.MovePlanner)
+        self.limits = [rail.get_range() if i in homing_axes else limit
+                       for i, (rail, limit) in enumerate(
+                           zip(self.rails, self.limits))]
+    def _home_axes(self, homing_state, axes, rails):
         # Determine movement
-        position_min, position_max = rail.get_range()
-        hi = rail.get_homing_info()
         homepos = [None, None, None, None]
-        homepos[axis] = hi.position_endstop
         forcepos = list(homepos)
-        if hi.positive_dir:
-            forcepos[axis] -= 1.5 * (hi.position_endstop - position_min)
-        else:
-            forcepos[axis] += 1.5 * (position_max - hi.position_endstop)
+        for axis, rail in zip(axes, rails):
+            position_min, position_max = rail.get_range()
+            hi = rail.get_homing_info()
+            homepos[axis] = hi.position_endstop
+            if hi.positive_dir:
+                forcepos[axis] = (hi.position_endstop
+                                  - 1.5 * (hi.position_endstop - position_min))
+            else:
+                forcepos[axis] = (hi.position_endstop
+                                  + 1.5 * (position_max - hi.position_endstop))
         # Perform homing
         limit_speed = None
-        if axis == 2:
+        if 2 in axes:
             limit_speed = self.max_z_velocity
-        homing_state.home_rails([rail], forcepos, homepos, limit_speed)
+        homing_state.home_rails(rails, forcepos, homepos, limit_speed)
     def home(self, homing_state):
-        # Each axis is homed independently and in order
-        for axis in homing_state.get_axes():
+        axes = homing_state.get_axes()
+        if self.concurrent_homing:
+            # Home the independent x and y axes together
+            xy_axes = [axis for axis in axes
+                       if axis in (0, 1) and axis != self.dual_carriage_axis]
+            if len(xy_axes) > 1:
+                self._home_axes(homing_state, xy_axes,
+                                [self.rails[axis] for axis in xy_axes])
+                axes = [axis for axis in axes if axis not in xy_axes]
+        # Each remaining axis is homed independently and in order
+        for axis in axes:
             if axis == self.dual_carriage_axis:
                 dc1, dc2 = self.dual_carriage_rails
                 altc = self.rails[axis] == dc2
                 self._activate_carriage(0)
-                self._home_axis(homing_state, axis, dc1)
+                self._home_axes(homing_state, [axis], [dc1])
                 self._activate_carriage(1)
-                self._home_axis(homing_state, axis, dc2)
+                self._home_axes(homing_state, [axis], [dc2])
                 self._activate_carriage(altc)
             else:
-                self._home_axis(homing_state, axis, self.rails[axis])
+                self._home_axes(homing_state, [axis], [self.rails[axis]])
     def motor_off(self, print_time):
         self.limits = [(1.0, -1.0)] * 3
         for rail in self.rails:
@@ -92,8 +111,9 @@ class CartKinematics:
         self.need_motor_enable = True
     def _check_motor_enable(self, print_time, move):
         need_motor_enable = False
+        axes_moving = move.axes_moving
         for i, rail in enumerate(self.rails):
-            if move.axes_d[i]:
+            if axes_moving[i]:
                 rail.motor_enable(print_time, 1)
             need_motor_enable |= not rail.is_motor_enabled()
         self.need_motor_enable = need_motor_enable
@@ -124,8 +144,9 @@ class CartKinematics:
     def move(self, print_time, move):
         if self.need_motor_enable:
             self._check_motor_enable(print_time, move)
+        axes_moving = move.axes_moving
         for i, rail in enumerate(self.rails):
-            if move.axes_d[i]:
+            if axes_moving[i]:
                 rail.step_itersolve(move.cmove)
     # Dual carriage support
     def _activate_carriage(self, carriage):
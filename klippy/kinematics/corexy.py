@@ -40,10 +40,16 @@ class CoreXYKinematics:
         pos = [rail.get_commanded_position() for rail in self.rails]
         return [0.5 * (pos[0] + pos[1]), 0.5 * (pos[0] - pos[1]), pos[2]]
     def set_position(self, newpos, homing_axes):
-        for i, rail in enumerate(self.rails):
+        for rail in self.rails:
             rail.set_position(newpos)
-            if i in homing_axes:
-                self.limits[i] = rail.get_range()
+        self.set_homed_axes(homing_axes)
+    def set_homed_axes(self, homing_axes):
+        # Enable moves on the given axes without changing the steppers
+        # (a new list is used as the limits may be shared with a copy
+        # of this object - see toolhead.MovePlanner)
+        self.limits = [rail.get_range() if i in homing_axes else limit
+                       for i, (rail, limit) in enumerate(
+                           zip(self.rails, self.limits))]
     def home(self, homing_state):
         # Each axis is homed independently and in order
         for axis in homing_state.get_axes():
@@ -69,10 +75,10 @@ class CoreXYKinematics:
             rail.motor_enable(print_time, 0)
         self.need_motor_enable = True
     def _check_motor_enable(self, print_time, move):
-        if move.axes_d[0] or move.axes_d[1]:
+        if move.axes_moving[0] or move.axes_moving[1]:
             self.rails[0].motor_enable(print_time, 1)
             self.rails[1].motor_enable(print_time, 1)
-        if move.axes_d[2]:
+        if move.axes_moving[2]:
             self.rails[2].motor_enable(print_time, 1)
         need_motor_enable = False
         for rail in self.rails:
@@ -105,13 +111,13 @@ class CoreXYKinematics:
     def move(self, print_time, move):
         if self.need_motor_enable:
             self._check_motor_enable(print_time, move)
-        axes_d = move.axes_d
+        axes_moving = move.axes_moving
         cmove = move.cmove
         rail_x, rail_y, rail_z = self.rails
-        if axes_d[0] or axes_d[1]:
+        if axes_moving[0] or axes_moving[1]:
             rail_x.step_itersolve(cmove)
             rail_y.step_itersolve(cmove)
-        if axes_d[2]:
+        if axes_moving[2]:
             rail_z.step_itersolve(cmove)
 
 def load_kinematics(toolhead, config):
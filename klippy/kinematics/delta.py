@@ -6,8 +6,11 @@
 import math, logging
 import stepper, homing, mathutil
 
-# Slow moves once the ratio of tower to XY movement exceeds SLOW_RATIO
+# Slow moves that require the towers to move more than SLOW_RATIO
+# times faster than the toolhead velocity and acceleration limits
 SLOW_RATIO = 3.
+# Number of points checked along a move near the edge of the build area
+TOWER_SAMPLES = 8
 
 class DeltaKinematics:
     def __init__(self, toolhead, config):
@@ -64,6 +67,9 @@ class DeltaKinematics:
         logging.info(
             "Delta max build height %.2fmm (radius tapered above %.2fmm)" % (
                 self.max_z, self.limit_z))
+        # Determine the maximum velocity and acceleration of the towers
+        self.max_tower_velocity = self.max_velocity * SLOW_RATIO
+        self.max_tower_accel = self.max_accel * SLOW_RATIO
         # Find the point where an XY move could result in excessive
         # tower movement
         half_min_step_dist = min([r.get_steppers()[0].get_step_dist()
@@ -73,15 +79,33 @@ class DeltaKinematics:
             return (ratio * math.sqrt(min_arm_length**2 / (ratio**2 + 1.)
                                       - half_min_step_dist**2)
                     + half_min_step_dist)
-        self.slow_xy2 = (ratio_to_dist(SLOW_RATIO) - radius)**2
-        self.very_slow_xy2 = (ratio_to_dist(2. * SLOW_RATIO) - radius)**2
+        self.slow_xy2 = max(0., self._find_fast_dist(min_arm_length)
+                            - radius)**2
         self.max_xy2 = min(radius, min_arm_length - radius,
                            ratio_to_dist(4. * SLOW_RATIO) - radius)**2
-        logging.info("Delta max build radius %.2fmm (moves slowed past %.2fmm"
-                     " and %.2fmm)" % (
-                         math.sqrt(self.max_xy2), math.sqrt(self.slow_xy2),
-                         math.sqrt(self.very_slow_xy2)))
+        logging.info("Delta max build radius %.2fmm (moves checked for"
+                     " tower limits past %.2fmm)" % (
+                         math.sqrt(self.max_xy2), math.sqrt(self.slow_xy2)))
         self.set_position([0., 0., 0.], ())
+    def _find_fast_dist(self, arm_length):
+        # Find the distance from a tower within which no XY move at the
+        # configured velocity and acceleration can exceed tower limits
+        arm2 = arm_length**2
+        low, high = 0., arm_length
+        for i in range(40):
+            dist = (low + high) * .5
+            height2 = arm2 - dist**2
+            height = math.sqrt(height2)
+            velocity_r = dist / height
+            accel_r = arm2 / (height2 * height)
+            tower_accel = (self.max_accel * velocity_r
+                           + self.max_velocity**2 * accel_r)
+            if (self.max_velocity * velocity_r > self.max_tower_velocity
+                or tower_accel > self.max_tower_accel):
+                high = dist
+            else:
+                low = dist
+        return low
     def get_steppers(self, flags=""):
         return [s for rail in self.rails for s in rail.get_steppers()]
     def _actuator_to_cartesian(self, spos):
@@ -93,6 +117,9 @@ class DeltaKinematics:
     def set_position(self, newpos, homing_axes):
         for rail in self.rails:
             rail.set_position(newpos)
+        self.set_homed_axes(homing_axes)
+    def set_homed_axes(self, homing_axes):
+        # Enable moves on the given axes without changing the steppers
         self.limit_xy2 = -1.
         if tuple(homing_axes) == (0, 1, 2):
             self.need_home = False
@@ -133,19 +160,65 @@ class DeltaKinematics:
         if move.axes_d[2]:
             move.limit_speed(self.max_z_velocity, move.accel)
             limit_xy2 = -1.
-        # Limit the speed/accel of this move if is is at the extreme
+        # Limit the speed/accel of this move if it is at the extreme
         # end of the build envelope
         extreme_xy2 = max(end_xy2, move.start_pos[0]**2 + move.start_pos[1]**2)
-        if extreme_xy2 > self.slow_xy2:
-            r = 0.5
-            if extreme_xy2 > self.very_slow_xy2:
-                r = 0.25
-            max_velocity = self.max_velocity
-            if move.axes_d[2]:
-                max_velocity = self.max_z_velocity
-            move.limit_speed(max_velocity * r, self.max_accel * r)
+        if extreme_xy2 > self.slow_xy2 or move.axes_d[2]:
+            self._limit_tower_speed(move)
             limit_xy2 = -1.
         self.limit_xy2 = min(limit_xy2, self.slow_xy2)
+    def _calc_tower_ratios(self, x, y, r_x, r_y, r_z):
+        # A carriage moves at velocity*velocity_r with acceleration
+        # accel*velocity_r + velocity^2*accel_r.  Return the largest
+        # ratios of the three towers at the given position.
+        r_xy2 = r_x**2 + r_y**2
+        max_velocity_r = max_accel_r = 0.
+        for arm2, tower in zip(self.arm2, self.towers):
+            dx = x - tower[0]
+            dy = y - tower[1]
+            height2 = arm2 - dx**2 - dy**2
+            height = math.sqrt(height2)
+            dist_r = dx * r_x + dy * r_y
+            max_velocity_r = max(max_velocity_r, abs(r_z - dist_r / height))
+            max_accel_r = max(max_accel_r, (r_xy2 * height2 + dist_r**2)
+                              / (height2 * height))
+        return max_velocity_r, max_accel_r
+    def _limit_tower_speed(self, move):
+        axes_d = move.axes_d
+        move_d = move.move_d
+        r_x, r_y, r_z = [axes_d[i] / move_d for i in (0, 1, 2)]
+        start_pos = move.start_pos
+        ratios = []
+        for i in range(TOWER_SAMPLES + 1):
+            move_r = float(i) / TOWER_SAMPLES
+            ratios.append((move_r * move_d,) + self._calc_tower_ratios(
+                start_pos[0] + axes_d[0] * move_r,
+                start_pos[1] + axes_d[1] * move_r, r_x, r_y, r_z))
+        # The velocity ratio changes monotonically along a straight
+        # line, so its peak is at the start or end of the move
+        max_velocity_r = max(ratios[0][1], ratios[-1][1])
+        max_tower_accel = self.max_tower_accel
+        accel = min(move.accel, .5 * max_tower_accel / max_velocity_r)
+        # Find the maximum toolhead velocity at each sampled point
+        limits = []
+        for move_d_i, velocity_r, accel_r in ratios:
+            max_v2 = (self.max_tower_velocity / velocity_r)**2
+            if accel_r:
+                max_v2 = min(max_v2, ((max_tower_accel - accel * velocity_r)
+                                      / accel_r))
+            limits.append((move_d_i, max_v2))
+        # Limit the junction velocities to the velocity permitted at the
+        # ends of the move.  The cruise velocity only needs to be limited
+        # at points the toolhead may reach at full speed.
+        start_v2 = limits[0][1]
+        end_v2 = limits[-1][1]
+        cruise_v2 = move.max_cruise_v2
+        for move_d_i, max_v2 in limits:
+            if (start_v2 + 2. * accel * move_d_i > max_v2
+                and end_v2 + 2. * accel * (move_d - move_d_i) > max_v2):
+                cruise_v2 = min(cruise_v2, max_v2)
+        move.limit_speed(math.sqrt(cruise_v2), accel)
+        move.limit_junction_speed(math.sqrt(start_v2), math.sqrt(end_v2))
     def move(self, print_time, move):
         if self.need_motor_enable:
             self._check_motor_enable(print_time)
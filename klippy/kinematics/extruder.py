@@ -49,6 +49,9 @@ class PrinterExtruder:
             'pressure_advance_lookahead_time', 0.010, minval=0.)
         self.need_motor_enable = True
         self.extrude_pos = 0.
+        self.max_step_rate = 0.
+        self.printer.register_event_handler("klippy:connect",
+                                            self._handle_connect)
         # Setup iterative solver
         ffi_main, ffi_lib = chelper.get_ffi()
         self.cmove = ffi_main.gc(ffi_lib.move_alloc(), ffi_lib.free)
@@ -76,6 +79,9 @@ class PrinterExtruder:
     def motor_off(self, print_time):
         self.stepper.motor_enable(print_time, 0)
         self.need_motor_enable = True
+    def _handle_connect(self):
+        max_rate, max_total_rate = self.stepper.get_mcu().get_max_step_rate()
+        self.max_step_rate = max_rate
     def check_move(self, move):
         move.extrude_r = move.axes_d[3] / move.move_d
         move.extrude_max_corner_v = 0.
@@ -83,6 +89,12 @@ class PrinterExtruder:
             raise homing.EndstopError(
                 "Extrude below minimum temp\n"
                 "See the 'min_extrude_temp' config option for details")
+        if self.max_step_rate:
+            # Don't exceed the step rate of the extruder's mcu
+            max_v = (self.max_step_rate * self.stepper.get_step_dist()
+                     / abs(move.extrude_r))
+            if max_v < move.max_cruise_v2**.5:
+                move.limit_speed(max_v, move.accel)
         if not move.is_kinematic_move or move.extrude_r < 0.:
             # Extrude only move (or retraction move) - limit accel and velocity
             if abs(move.axes_d[3]) > self.max_e_dist:
@@ -171,7 +183,7 @@ class PrinterExtruder:
         # Update for pressure advance
         extra_accel_v = extra_decel_v = 0.
         start_pos = self.extrude_pos
-        if (axis_d >= 0. and (move.axes_d[0] or move.axes_d[1])
+        if (axis_d >= 0. and (move.axes_moving[0] or move.axes_moving[1])
             and self.pressure_advance):
             # Calculate extra_accel_v
             pressure_advance = self.pressure_advance * move.extrude_r
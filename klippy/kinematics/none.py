@@ -13,6 +13,8 @@ class NoneKinematics:
         return [0, 0, 0]
     def set_position(self, newpos, homing_axes):
         pass
+    def set_homed_axes(self, homing_axes):
+        pass
     def home(self, homing_state):
         pass
     def motor_off(self, print_time):
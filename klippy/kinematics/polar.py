@@ -14,6 +14,10 @@ class PolarKinematics:
         rail_z = stepper.LookupMultiRail(config.getsection('stepper_z'))
         stepper_bed.setup_itersolve('polar_stepper_alloc', 'a')
         rail_arm.setup_itersolve('polar_stepper_alloc', 'r')
+        step_approximation = config.getfloat(
+            'step_approximation', 0., minval=0., maxval=.5)
+        stepper_bed.setup_approximation(step_approximation)
+        rail_arm.setup_approximation(step_approximation)
         rail_z.setup_itersolve('cartesian_stepper_alloc', 'z')
         self.rails = [rail_arm, rail_z]
         self.steppers = [stepper_bed] + [ s for r in self.rails
@@ -45,6 +49,9 @@ class PolarKinematics:
     def set_position(self, newpos, homing_axes):
         for s in self.steppers:
             s.set_position(newpos)
+        self.set_homed_axes(homing_axes)
+    def set_homed_axes(self, homing_axes):
+        # Enable moves on the given axes without changing the steppers
         if 2 in homing_axes:
             self.limit_z = self.rails[1].get_range()
         if 0 in homing_axes and 1 in homing_axes:
@@ -90,10 +97,10 @@ class PolarKinematics:
             s.motor_enable(print_time, 0)
         self.need_motor_enable = True
     def _check_motor_enable(self, print_time, move):
-        if move.axes_d[0] or move.axes_d[1]:
+        if move.axes_moving[0] or move.axes_moving[1]:
             self.steppers[0].motor_enable(print_time, 1)
             self.rails[0].motor_enable(print_time, 1)
-        if move.axes_d[2]:
+        if move.axes_moving[2]:
             self.rails[1].motor_enable(print_time, 1)
         need_motor_enable = not self.steppers[0].is_motor_enabled()
         for rail in self.rails:
@@ -119,12 +126,12 @@ class PolarKinematics:
     def move(self, print_time, move):
         if self.need_motor_enable:
             self._check_motor_enable(print_time, move)
-        axes_d = move.axes_d
+        axes_moving = move.axes_moving
         cmove = move.cmove
-        if axes_d[0] or axes_d[1]:
+        if axes_moving[0] or axes_moving[1]:
             self.steppers[0].step_itersolve(cmove)
             self.rails[0].step_itersolve(cmove)
-        if axes_d[2]:
+        if axes_moving[2]:
             self.rails[1].step_itersolve(cmove)
 
 def load_kinematics(toolhead, config):
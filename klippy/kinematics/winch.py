@@ -10,6 +10,8 @@ class WinchKinematics:
         # Setup steppers at each anchor
         self.steppers = []
         self.anchors = []
+        step_approximation = config.getfloat(
+            'step_approximation', 0., minval=0., maxval=.5)
         for i in range(26):
             name = 'stepper_' + chr(ord('a') + i)
             if i >= 3 and not config.has_section(name):
@@ -20,6 +22,7 @@ class WinchKinematics:
             a = tuple([stepper_config.getfloat('anchor_' + n) for n in 'xyz'])
             self.anchors.append(a)
             s.setup_itersolve('winch_stepper_alloc', *a)
+            s.setup_approximation(step_approximation)
         # Setup stepper max halt velocity
         max_velocity, max_accel = toolhead.get_max_velocity()
         max_halt_velocity = toolhead.get_max_axis_halt()
@@ -37,6 +40,8 @@ class WinchKinematics:
     def set_position(self, newpos, homing_axes):
         for s in self.steppers:
             s.set_position(newpos)
+    def set_homed_axes(self, homing_axes):
+        pass
     def home(self, homing_state):
         # XXX - homing not implemented
         homing_state.set_axes([0, 1, 2])
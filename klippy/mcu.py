@@ -20,14 +20,14 @@ class MCU_stepper:
         self._invert_step = pin_params['invert']
         self._dir_pin = self._invert_dir = None
         self._mcu_position_offset = 0.
-        self._step_dist = 0.
+        self._step_dist = self._min_step_dist = 0.
         self._min_stop_interval = 0.
         self._reset_cmd_id = self._get_position_cmd = None
         ffi_main, self._ffi_lib = chelper.get_ffi()
         self._stepqueue = ffi_main.gc(self._ffi_lib.stepcompress_alloc(oid),
                                       self._ffi_lib.stepcompress_free)
         self._mcu.register_stepqueue(self._stepqueue)
-        self._stepper_kinematics = self._itersolve_gen_steps = None
+        self._stepper_kinematics = self._itersolve_queue_move = None
         self.set_ignore_move(False)
     def get_mcu(self):
         return self._mcu
@@ -39,11 +39,15 @@ class MCU_stepper:
     def setup_min_stop_interval(self, min_stop_interval):
         self._min_stop_interval = min_stop_interval
     def setup_step_distance(self, step_dist):
-        self._step_dist = step_dist
+        self._step_dist = self._min_step_dist = step_dist
     def setup_itersolve(self, alloc_func, *params):
         ffi_main, ffi_lib = chelper.get_ffi()
-        sk = ffi_main.gc(getattr(ffi_lib, alloc_func)(*params), ffi_lib.free)
+        sk = ffi_main.gc(getattr(ffi_lib, alloc_func)(*params),
+                         ffi_lib.itersolve_free)
         self.set_stepper_kinematics(sk)
+    def setup_approximation(self, max_step_error):
+        self._ffi_lib.itersolve_set_approximation(
+            self._stepper_kinematics, max_step_error)
     def _build_config(self):
         max_error = self._mcu.get_max_stepper_error()
         min_stop_interval = max(0., self._min_stop_interval - max_error)
@@ -75,7 +79,23 @@ class MCU_stepper:
             self._stepper_kinematics, coord[0], coord[1], coord[2])
     def set_position(self, coord):
         self.set_commanded_position(self.calc_position_from_coord(coord))
+    def calc_max_step_rate(self, start_coord, end_coord):
+        # Return the peak steps per mm of toolhead movement on a line
+        # (using the finest step distance as the step distance may be
+        # changed when the move is flushed)
+        return self._ffi_lib.itersolve_calc_max_rate(
+            self._stepper_kinematics, start_coord[0], start_coord[1],
+            start_coord[2], end_coord[0], end_coord[1], end_coord[2]
+        ) / self._min_step_dist
+    def _generate_pending_steps(self):
+        # Create the steps of any queued moves so that the commanded
+        # position reflects all moves issued so far
+        ret = self._ffi_lib.itersolve_generate_steps(
+            self._stepper_kinematics, float('inf'))
+        if ret:
+            raise error("Internal error in stepcompress")
     def get_commanded_position(self):
+        self._generate_pending_steps()
         return self._ffi_lib.itersolve_get_commanded_pos(
             self._stepper_kinematics)
     def set_commanded_position(self, pos):
@@ -87,20 +107,34 @@ class MCU_stepper:
         if mcu_pos >= 0.:
             return int(mcu_pos + 0.5)
         return int(mcu_pos - 0.5)
+    def set_step_distance(self, step_dist):
+        # Change the step distance of all future moves (eg, after a
+        # change to the driver's microstep resolution)
+        mcu_pos = self.get_mcu_position()
+        self._step_dist = step_dist
+        self._min_step_dist = min(self._min_step_dist, step_dist)
+        self._mcu_position_offset = (mcu_pos * step_dist
+                                     - self.get_commanded_position())
+        ret = self._ffi_lib.itersolve_set_stepcompress(
+            self._stepper_kinematics, self._stepqueue, step_dist)
+        if ret:
+            raise error("Internal error in stepcompress")
     def set_stepper_kinematics(self, sk):
         old_sk = self._stepper_kinematics
         self._stepper_kinematics = sk
         if sk is not None:
-            self._ffi_lib.itersolve_set_stepcompress(
+            ret = self._ffi_lib.itersolve_set_stepcompress(
                 sk, self._stepqueue, self._step_dist)
+            if ret:
+                raise error("Internal error in stepcompress")
         return old_sk
     def set_ignore_move(self, ignore_move):
-        was_ignore = (self._itersolve_gen_steps
-                      is not self._ffi_lib.itersolve_gen_steps)
+        was_ignore = (self._itersolve_queue_move
+                      is not self._ffi_lib.itersolve_queue_move)
         if ignore_move:
-            self._itersolve_gen_steps = (lambda *args: 0)
+            self._itersolve_queue_move = (lambda *args: 0)
         else:
-            self._itersolve_gen_steps = self._ffi_lib.itersolve_gen_steps
+            self._itersolve_queue_move = self._ffi_lib.itersolve_queue_move
         return was_ignore
     def note_homing_start(self, homing_clock):
         ret = self._ffi_lib.stepcompress_set_homing(
@@ -129,7 +163,7 @@ class MCU_stepper:
         self._ffi_lib.itersolve_set_commanded_pos(
             self._stepper_kinematics, mcu_pos_dist - self._mcu_position_offset)
     def step_itersolve(self, cmove):
-        ret = self._itersolve_gen_steps(self._stepper_kinematics, cmove)
+        ret = self._itersolve_queue_move(self._stepper_kinematics, cmove)
         if ret:
             raise error("Internal error in stepcompress")
 
@@ -144,8 +178,9 @@ class MCU_endstop:
         self._pullup = pin_params['pullup']
         self._invert = pin_params['invert']
         self._oid = self._home_cmd = self._query_cmd = None
+        self._program_cmd = None
         self._mcu.register_config_callback(self._build_config)
-        self._homing = False
+        self._homing = self._retract_error = False
         self._min_query_time = 0.
         self._next_query_print_time = 0.
         self._last_state = {}
@@ -175,10 +210,16 @@ class MCU_endstop:
         self._home_cmd = self._mcu.lookup_command(
             "end_stop_home oid=%c clock=%u sample_ticks=%u sample_count=%c"
             " rest_ticks=%u pin_value=%c", cq=cmd_queue)
+        self._program_cmd = self._mcu.lookup_command(
+            "end_stop_home_program oid=%c delay_ticks=%u retract_ticks=%u"
+            " retract_count=%hu approach_ticks=%u approach_count=%hu",
+            cq=cmd_queue)
         self._query_cmd = self._mcu.lookup_command(
             "end_stop_query_state oid=%c", cq=cmd_queue)
         self._mcu.register_msg(self._handle_end_stop_state, "end_stop_state"
                                , self._oid)
+        self._mcu.register_msg(self._handle_retract_error,
+                               "end_stop_retract_error", self._oid)
     def home_prepare(self):
         pass
     def home_start(self, print_time, sample_time, sample_count, rest_time,
@@ -186,6 +227,7 @@ class MCU_endstop:
         clock = self._mcu.print_time_to_clock(print_time)
         rest_ticks = int(rest_time * self._mcu.get_adjusted_freq())
         self._homing = True
+        self._retract_error = False
         self._min_query_time = self._mcu.monotonic()
         self._next_query_print_time = print_time + self.RETRY_QUERY
         self._home_cmd.send(
@@ -194,6 +236,16 @@ class MCU_endstop:
             reqclock=clock)
         for s in self._steppers:
             s.note_homing_start(clock)
+    def home_program(self, print_time, delay, retract_time, retract_count,
+                     approach_time, approach_count):
+        # Have the mcu retract and approach again after the endstop
+        # triggers (must be called after home_start)
+        clock = self._mcu.print_time_to_clock(print_time)
+        freq = self._mcu.get_adjusted_freq()
+        self._program_cmd.send(
+            [self._oid, int(delay * freq), int(retract_time * freq),
+             retract_count, int(approach_time * freq), approach_count],
+            reqclock=clock)
     def home_wait(self, home_end_time):
         eventtime = self._mcu.monotonic()
         while self._check_busy(eventtime, home_end_time):
@@ -203,6 +255,9 @@ class MCU_endstop:
     def _handle_end_stop_state(self, params):
         logging.debug("end_stop_state %s", params)
         self._last_state = params
+    def _handle_retract_error(self, params):
+        logging.debug("end_stop_retract_error %s", params)
+        self._retract_error = True
     def _check_busy(self, eventtime, home_end_time=0.):
         # Check if need to send an end_stop_query command
         last_sent_time = self._last_state.get('#sent_time', -1.)
@@ -213,6 +268,9 @@ class MCU_endstop:
                 for s in self._steppers:
                     s.note_homing_end(did_trigger=True)
                 self._homing = False
+                if self._retract_error:
+                    raise self.TimeoutError(
+                        "Endstop still triggered after retract")
                 return False
             last_sent_print_time = self._mcu.estimated_print_time(
                 last_sent_time)
@@ -418,6 +476,16 @@ class MCU_adc:
         if self._callback is not None:
             self._callback(last_read_time, last_value)
 
+# Measured step performance of each micro-controller type (see the
+# "Step Benchmarks" in docs/Features.md) as the number of mcu clock
+# ticks per step with one stepper and with three steppers active
+STEP_BENCHMARKS = {
+    'atmega': (106, 160), 'at90usb': (106, 160),
+    'sam3x': (575, 192), 'sam4s': (623, 208), 'sam4e': (525, 175),
+    'samd21': (410, 221), 'samd51': (655, 173), 'lpc176x': (545, 182),
+    'stm32f103': (365, 202), 'pru': (882, 294),
+}
+
 class MCU:
     error = error
     def __init__(self, config, clocksync):
@@ -462,9 +530,13 @@ class MCU:
         ffi_main, self._ffi_lib = chelper.get_ffi()
         self._max_stepper_error = config.getfloat(
             'max_stepper_error', 0.000025, minval=0.)
+        self._max_step_rate = config.getfloat('max_step_rate', None, minval=0.)
+        self._max_total_step_rate = config.getfloat(
+            'max_total_step_rate', None, minval=0.)
         self._move_count = 0
         self._stepqueues = []
         self._steppersync = None
+        self._flush_interval = 0.
         # Stats
         self._stats_sumsq_base = 0.
         self._mcu_tick_avg = 0.
@@ -593,11 +665,19 @@ class MCU:
             self._send_config(config_params['crc'])
         # Setup steppersync with the move_count returned by get_config
         self._move_count = config_params['move_count']
-        self._steppersync = self._ffi_lib.steppersync_alloc(
+        if not self._stepqueues:
+            return
+        steppersync = self._ffi_lib.steppersync_alloc(
             self._serial.serialqueue, self._stepqueues, len(self._stepqueues),
             self._move_count)
+        if not steppersync:
+            raise error("Unable to allocate steppersync for MCU '%s'" % (
+                self._name,))
+        self._steppersync = steppersync
         self._ffi_lib.steppersync_set_time(
             self._steppersync, 0., self._mcu_freq)
+        self._ffi_lib.steppersync_set_flush_interval(
+            self._steppersync, self.seconds_to_clock(self._flush_interval))
     def _connect(self):
         if self.is_fileoutput():
             self._connect_file()
@@ -658,10 +738,26 @@ class MCU:
         return self.print_time_to_clock(t) + slot
     def register_stepqueue(self, stepqueue):
         self._stepqueues.append(stepqueue)
+    def setup_flush_interval(self, flush_interval):
+        self._flush_interval = flush_interval
     def seconds_to_clock(self, time):
         return int(time * self._mcu_freq)
     def get_max_stepper_error(self):
         return self._max_stepper_error
+    def get_max_step_rate(self):
+        # Return the maximum steps per second of a single stepper and of
+        # all steppers combined (zero if there is no known limit)
+        max_rate, max_total_rate = 0., 0.
+        mcu_type = self._serial.msgparser.get_constant('MCU', '')
+        for prefix, (step_ticks, total_step_ticks) in STEP_BENCHMARKS.items():
+            if mcu_type.startswith(prefix):
+                max_rate = self._mcu_freq / step_ticks
+                max_total_rate = self._mcu_freq / total_step_ticks
+        if self._max_step_rate is not None:
+            max_rate = self._max_step_rate
+        if self._max_total_step_rate is not None:
+            max_total_rate = self._max_total_step_rate
+        return max_rate, max_total_rate
     # Wrapper functions
     def register_msg(self, cb, msg, oid=None):
         self._serial.register_callback(cb, msg, oid)
@@ -694,10 +790,11 @@ class MCU:
         return self._reactor.monotonic()
     # Restarts
     def _disconnect(self):
-        self._serial.disconnect()
+        # Stop the steppersync thread before the serial port goes away
         if self._steppersync is not None:
             self._ffi_lib.steppersync_free(self._steppersync)
             self._steppersync = None
+        self._serial.disconnect()
     def _shutdown(self, force=False):
         if (self._emergency_stop_cmd is None
             or (self._is_shutdown and not force)):
@@ -744,13 +841,16 @@ class MCU:
         return self._printer.get_start_args().get('debugoutput') is not None
     def is_shutdown(self):
         return self._is_shutdown
-    def flush_moves(self, print_time):
+    def flush_moves(self, print_time, lazy=False):
         if self._steppersync is None:
             return
         clock = self.print_time_to_clock(print_time)
         if clock < 0:
             return
-        ret = self._ffi_lib.steppersync_flush(self._steppersync, clock)
+        if lazy:
+            ret = self._ffi_lib.steppersync_flush_lazy(self._steppersync, clock)
+        else:
+            ret = self._ffi_lib.steppersync_flush(self._steppersync, clock)
         if ret:
             raise error("Internal error in MCU '%s' stepcompress" % (
                 self._name,))
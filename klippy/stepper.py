@@ -65,14 +65,18 @@ class PrinterStepper:
         # Wrappers
         self.step_itersolve = mcu_stepper.step_itersolve
         self.setup_itersolve = mcu_stepper.setup_itersolve
+        self.setup_approximation = mcu_stepper.setup_approximation
         self.set_stepper_kinematics = mcu_stepper.set_stepper_kinematics
         self.set_ignore_move = mcu_stepper.set_ignore_move
         self.calc_position_from_coord = mcu_stepper.calc_position_from_coord
+        self.calc_max_step_rate = mcu_stepper.calc_max_step_rate
         self.set_position = mcu_stepper.set_position
         self.get_commanded_position = mcu_stepper.get_commanded_position
         self.set_commanded_position = mcu_stepper.set_commanded_position
         self.get_mcu_position = mcu_stepper.get_mcu_position
         self.get_step_dist = mcu_stepper.get_step_dist
+        self.set_step_distance = mcu_stepper.set_step_distance
+        self.get_mcu = mcu_stepper.get_mcu
     def get_name(self, short=False):
         if short and self.name.startswith('stepper_'):
             return self.name[8:]
@@ -116,6 +120,7 @@ class PrinterRail:
         self.step_itersolve = stepper.step_itersolve
         self.get_commanded_position = stepper.get_commanded_position
         self.is_motor_enabled = stepper.is_motor_enabled
+        self.get_mcu = stepper.get_mcu
         # Primary endstop and its position
         printer = config.get_printer()
         ppins = printer.lookup_object('pins')
@@ -150,6 +155,7 @@ class PrinterRail:
             'second_homing_speed', self.homing_speed/2., above=0.)
         self.homing_retract_dist = config.getfloat(
             'homing_retract_dist', 5., minval=0.)
+        self.mcu_homing = config.getboolean('mcu_homing', False)
         self.homing_positive_dir = config.getboolean(
             'homing_positive_dir', None)
         if self.homing_positive_dir is None:
@@ -167,10 +173,10 @@ class PrinterRail:
     def get_homing_info(self):
         homing_info = collections.namedtuple('homing_info', [
             'speed', 'position_endstop', 'retract_dist', 'positive_dir',
-            'second_homing_speed'])(
+            'second_homing_speed', 'mcu_homing'])(
                 self.homing_speed, self.position_endstop,
                 self.homing_retract_dist, self.homing_positive_dir,
-                self.second_homing_speed)
+                self.second_homing_speed, self.mcu_homing)
         return homing_info
     def get_steppers(self):
         return list(self.steppers)
@@ -200,6 +206,9 @@ class PrinterRail:
     def setup_itersolve(self, alloc_func, *params):
         for stepper in self.steppers:
             stepper.setup_itersolve(alloc_func, *params)
+    def setup_approximation(self, max_step_error):
+        for stepper in self.steppers:
+            stepper.setup_approximation(max_step_error)
     def set_max_jerk(self, max_halt_velocity, max_accel):
         for stepper in self.steppers:
             stepper.set_max_jerk(max_halt_velocity, max_accel)
@@ -3,197 +3,328 @@
 # Copyright (C) 2016-2018  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import math, logging, importlib
+import math, logging, importlib, copy
 import mcu, homing, chelper, kinematics.extruder
 
 # Common suffixes: _d is distance (in mm), _v is velocity (in
 #   mm/second), _v2 is velocity squared (mm^2/s^2), _t is time (in
 #   seconds), _r is ratio (scalar between 0.0 and 1.0)
 
-# Class to track each move request
-class Move:
-    def __init__(self, toolhead, start_pos, end_pos, speed):
-        self.toolhead = toolhead
-        self.start_pos = tuple(start_pos)
-        self.end_pos = tuple(end_pos)
-        self.accel = toolhead.max_accel
-        velocity = min(speed, toolhead.max_velocity)
-        self.cmove = toolhead.cmove
-        self.is_kinematic_move = True
-        self.axes_d = axes_d = [end_pos[i] - start_pos[i] for i in (0, 1, 2, 3)]
-        self.move_d = move_d = math.sqrt(sum([d*d for d in axes_d[:3]]))
-        if move_d < .000000001:
-            # Extrude only move
-            self.end_pos = (start_pos[0], start_pos[1], start_pos[2],
-                            end_pos[3])
-            axes_d[0] = axes_d[1] = axes_d[2] = 0.
-            self.move_d = move_d = abs(axes_d[3])
-            self.accel = 99999999.9
-            velocity = speed
-            self.is_kinematic_move = False
-        self.min_move_t = move_d / velocity
-        # Junction speeds are tracked in velocity squared.  The
-        # delta_v2 is the maximum amount of this squared-velocity that
-        # can change in this move.
-        self.max_start_v2 = 0.
-        self.max_cruise_v2 = velocity**2
-        self.delta_v2 = 2.0 * move_d * self.accel
-        self.max_smoothed_v2 = 0.
-        self.smooth_delta_v2 = 2.0 * move_d * toolhead.max_accel_to_decel
+# Accessor for a move stored in the look-ahead queue.  The move data
+# itself is kept in C arrays (see chelper/moveq.c) and Move objects
+# are reused for every move placed at the same queue position, so
+# callers must not retain a Move after check_move() or move() returns.
+class Move(object):
+    __slots__ = ['toolhead', 'move_queue', 'mq', 'index', 'cmove']
+    def __init__(self, move_queue, index):
+        self.toolhead = move_queue.toolhead
+        self.move_queue = move_queue
+        self.mq = move_queue.mq
+        self.index = index
+        self.cmove = self.toolhead.cmove
+    def _field(name):
+        def get(self):
+            return getattr(self.mq, name)[self.index]
+        def set(self, val):
+            getattr(self.mq, name)[self.index] = val
+        return property(get, set)
+    is_kinematic_move = _field('is_kinematic_move')
+    move_d = _field('move_d')
+    accel = _field('accel')
+    min_move_t = _field('min_move_t')
+    max_start_v2 = _field('max_start_v2')
+    max_cruise_v2 = _field('max_cruise_v2')
+    accel_t = _field('accel_t')
+    cruise_t = _field('cruise_t')
+    decel_t = _field('decel_t')
+    start_v = _field('start_v')
+    cruise_v = _field('cruise_v')
+    end_v = _field('end_v')
+    extrude_r = _field('extrude_r')
+    extrude_max_corner_v = _field('extrude_max_corner_v')
+    del _field
+    @property
+    def start_pos(self):
+        i = self.index * 4
+        return tuple(self.mq.start_pos[i:i+4])
+    @property
+    def end_pos(self):
+        i = self.index * 4
+        return tuple(self.mq.end_pos[i:i+4])
+    @property
+    def axes_d(self):
+        return self.mq.axes_d + self.index * 4
+    @property
+    def sequence(self):
+        # Number of moves queued before this move
+        return self.move_queue.issued_count + self.index
+    @property
+    def axes_moving(self):
+        # Non-zero for each axis that moves.  A corner blend can move an
+        # axis (eg, on a reversal) even though its net distance is zero.
+        mq, index = self.mq, self.index
+        if not mq.is_blend[index]:
+            return mq.axes_d + index * 4
+        i = index * 3
+        start_r, end_r = mq.blend_start_r, mq.blend_end_r
+        return [start_r[i] or end_r[i], start_r[i+1] or end_r[i+1],
+                start_r[i+2] or end_r[i+2], mq.axes_d[index*4 + 3]]
     def limit_speed(self, speed, accel):
-        speed2 = speed**2
-        if speed2 < self.max_cruise_v2:
-            self.max_cruise_v2 = speed2
-            self.min_move_t = self.move_d / speed
-        self.accel = min(self.accel, accel)
-        self.delta_v2 = 2.0 * self.move_d * self.accel
-        self.smooth_delta_v2 = min(self.smooth_delta_v2, self.delta_v2)
+        self.move_queue.moveq_limit_speed(self.mq, self.index, speed, accel)
+    def limit_junction_speed(self, start_speed, end_speed):
+        self.move_queue.moveq_limit_junction_speed(
+            self.mq, self.index, start_speed, end_speed)
     def calc_junction(self, prev_move):
         if not self.is_kinematic_move or not prev_move.is_kinematic_move:
             return
         # Allow extruder to calculate its maximum junction
         extruder_v2 = self.toolhead.extruder.calc_junction(prev_move, self)
-        # Find max velocity using "approximated centripetal velocity"
-        axes_d = self.axes_d
-        prev_axes_d = prev_move.axes_d
-        junction_cos_theta = -((axes_d[0] * prev_axes_d[0]
-                                + axes_d[1] * prev_axes_d[1]
-                                + axes_d[2] * prev_axes_d[2])
-                               / (self.move_d * prev_move.move_d))
-        if junction_cos_theta > 0.999999:
-            return
-        junction_cos_theta = max(junction_cos_theta, -0.999999)
-        sin_theta_d2 = math.sqrt(0.5*(1.0-junction_cos_theta))
-        R = (self.toolhead.junction_deviation * sin_theta_d2
-             / (1. - sin_theta_d2))
-        tan_theta_d2 = sin_theta_d2 / math.sqrt(0.5*(1.0+junction_cos_theta))
-        move_centripetal_v2 = .5 * self.move_d * tan_theta_d2 * self.accel
-        prev_move_centripetal_v2 = (.5 * prev_move.move_d * tan_theta_d2
-                                    * prev_move.accel)
-        self.max_start_v2 = min(
-            R * self.accel, R * prev_move.accel,
-            move_centripetal_v2, prev_move_centripetal_v2,
-            extruder_v2, self.max_cruise_v2, prev_move.max_cruise_v2,
-            prev_move.max_start_v2 + prev_move.delta_v2)
-        self.max_smoothed_v2 = min(
-            self.max_start_v2
-            , prev_move.max_smoothed_v2 + prev_move.smooth_delta_v2)
-    def set_junction(self, start_v2, cruise_v2, end_v2):
-        # Determine accel, cruise, and decel portions of the move distance
-        inv_delta_v2 = 1. / self.delta_v2
-        self.accel_r = accel_r = (cruise_v2 - start_v2) * inv_delta_v2
-        self.decel_r = decel_r = (cruise_v2 - end_v2) * inv_delta_v2
-        self.cruise_r = cruise_r = 1. - accel_r - decel_r
-        # Determine move velocities
-        self.start_v = start_v = math.sqrt(start_v2)
-        self.cruise_v = cruise_v = math.sqrt(cruise_v2)
-        self.end_v = end_v = math.sqrt(end_v2)
-        # Determine time spent in each portion of move (time is the
-        # distance divided by average velocity)
-        self.accel_t = accel_r * self.move_d / ((start_v + cruise_v) * 0.5)
-        self.cruise_t = cruise_r * self.move_d / cruise_v
-        self.decel_t = decel_r * self.move_d / ((end_v + cruise_v) * 0.5)
+        self.move_queue.moveq_calc_junction(
+            self.mq, self.index, extruder_v2, self.toolhead.junction_deviation)
     def move(self):
         # Generate step times for the move
-        next_move_time = self.toolhead.get_next_move_time()
-        if self.is_kinematic_move:
-            self.toolhead.move_fill(
-                self.cmove, next_move_time,
-                self.accel_t, self.cruise_t, self.decel_t,
-                self.start_pos[0], self.start_pos[1], self.start_pos[2],
-                self.axes_d[0], self.axes_d[1], self.axes_d[2],
-                self.start_v, self.cruise_v, self.accel)
-            self.toolhead.kin.move(next_move_time, self)
-        if self.axes_d[3]:
-            self.toolhead.extruder.move(next_move_time, self)
-        self.toolhead.update_move_time(
-            self.accel_t + self.cruise_t + self.decel_t)
+        toolhead = self.toolhead
+        mq, index = self.mq, self.index
+        next_move_time = toolhead.get_next_move_time()
+        if mq.is_kinematic_move[index]:
+            self.move_queue.moveq_fill(mq, index, self.cmove, next_move_time)
+            for cb in toolhead.move_callbacks:
+                cb(next_move_time, self)
+            toolhead.kin.move(next_move_time, self)
+        if mq.axes_d[index*4 + 3]:
+            toolhead.extruder.move(next_move_time, self)
+        toolhead.update_move_time(
+            mq.accel_t[index] + mq.cruise_t[index] + mq.decel_t[index])
 
 LOOKAHEAD_FLUSH_TIME = 0.250
 
 # Class to track a list of pending move requests and to facilitate
 # "look-ahead" across moves to reduce acceleration between moves.
 class MoveQueue:
-    def __init__(self):
+    def __init__(self, toolhead, move_class=Move):
+        self.toolhead = toolhead
+        self.move_class = move_class
         self.extruder_lookahead = None
-        self.queue = []
-        self.leftover = 0
+        ffi_main, ffi_lib = chelper.get_ffi()
+        self.mq = ffi_main.gc(ffi_lib.moveq_alloc(), ffi_lib.moveq_free)
+        self.moveq_reset = ffi_lib.moveq_reset
+        self.moveq_end_merge = ffi_lib.moveq_end_merge
+        self.moveq_set_blend_tolerance = ffi_lib.moveq_set_blend_tolerance
+        self.moveq_prepare = ffi_lib.moveq_prepare
+        self.moveq_add = ffi_lib.moveq_add
+        self.moveq_merge = ffi_lib.moveq_merge
+        self.moveq_limit_speed = ffi_lib.moveq_limit_speed
+        self.moveq_limit_junction_speed = ffi_lib.moveq_limit_junction_speed
+        self.moveq_calc_junction = ffi_lib.moveq_calc_junction
+        self.moveq_plan = ffi_lib.moveq_plan
+        self.moveq_fill = ffi_lib.moveq_fill
+        self.moveq_pop = ffi_lib.moveq_pop
+        self.moves = []
+        self.issued_count = 0
         self.junction_flush = LOOKAHEAD_FLUSH_TIME
+        self.merge_tolerance = 0.
     def reset(self):
-        del self.queue[:]
-        self.leftover = 0
+        self.issued_count += self.mq.count
+        self.moveq_reset(self.mq)
         self.junction_flush = LOOKAHEAD_FLUSH_TIME
     def set_flush_time(self, flush_time):
         self.junction_flush = flush_time
     def set_extruder(self, extruder):
         self.extruder_lookahead = extruder.lookahead
+    def set_merge_tolerance(self, merge_tolerance):
+        self.merge_tolerance = merge_tolerance
+    def set_blend_tolerance(self, blend_tolerance):
+        self.moveq_set_blend_tolerance(self.mq, blend_tolerance)
+    def is_empty(self):
+        return not self.mq.count
+    def get_next_sequence(self):
+        # Later moves are not merged into the moves already queued
+        self.moveq_end_merge(self.mq)
+        return self.issued_count + self.mq.count
     def flush(self, lazy=False):
         self.junction_flush = LOOKAHEAD_FLUSH_TIME
-        update_flush_count = lazy
-        queue = self.queue
-        flush_count = len(queue)
-        # Traverse queue from last to first move and determine maximum
-        # junction speed assuming the robot comes to a complete stop
-        # after the last move.
-        delayed = []
-        next_end_v2 = next_smoothed_v2 = peak_cruise_v2 = 0.
-        for i in range(flush_count-1, self.leftover-1, -1):
-            move = queue[i]
-            reachable_start_v2 = next_end_v2 + move.delta_v2
-            start_v2 = min(move.max_start_v2, reachable_start_v2)
-            reachable_smoothed_v2 = next_smoothed_v2 + move.smooth_delta_v2
-            smoothed_v2 = min(move.max_smoothed_v2, reachable_smoothed_v2)
-            if smoothed_v2 < reachable_smoothed_v2:
-                # It's possible for this move to accelerate
-                if (smoothed_v2 + move.smooth_delta_v2 > next_smoothed_v2
-                    or delayed):
-                    # This move can decelerate or this is a full accel
-                    # move after a full decel move
-                    if update_flush_count and peak_cruise_v2:
-                        flush_count = i
-                        update_flush_count = False
-                    peak_cruise_v2 = min(move.max_cruise_v2, (
-                        smoothed_v2 + reachable_smoothed_v2) * .5)
-                    if delayed:
-                        # Propagate peak_cruise_v2 to any delayed moves
-                        if not update_flush_count and i < flush_count:
-                            for m, ms_v2, me_v2 in delayed:
-                                mc_v2 = min(peak_cruise_v2, ms_v2)
-                                m.set_junction(min(ms_v2, mc_v2), mc_v2
-                                               , min(me_v2, mc_v2))
-                        del delayed[:]
-                if not update_flush_count and i < flush_count:
-                    cruise_v2 = min((start_v2 + reachable_start_v2) * .5
-                                    , move.max_cruise_v2, peak_cruise_v2)
-                    move.set_junction(min(start_v2, cruise_v2), cruise_v2
-                                      , min(next_end_v2, cruise_v2))
-            else:
-                # Delay calculating this move until peak_cruise_v2 is known
-                delayed.append((move, start_v2, next_end_v2))
-            next_end_v2 = start_v2
-            next_smoothed_v2 = smoothed_v2
-        if update_flush_count:
+        # Determine the velocity of moves ready to be flushed
+        flush_count = self.moveq_plan(self.mq, lazy)
+        if flush_count < 0:
             return
         # Allow extruder to do its lookahead
-        move_count = self.extruder_lookahead(queue, flush_count, lazy)
+        moves = self.moves
+        move_count = self.extruder_lookahead(moves, flush_count, lazy)
         # Generate step times for all moves ready to be flushed
-        for move in queue[:move_count]:
-            move.move()
+        for i in range(move_count):
+            moves[i].move()
         # Remove processed moves from the queue
-        self.leftover = flush_count - move_count
-        del queue[:move_count]
+        self.moveq_pop(self.mq, flush_count, move_count)
+        self.issued_count += move_count
+    def prepare_move(self, start_pos, end_pos, speed):
+        toolhead = self.toolhead
+        index = self.moveq_prepare(
+            self.mq, start_pos, end_pos, speed, toolhead.max_velocity,
+            toolhead.max_accel, toolhead.max_accel_to_decel)
+        if index < 0:
+            raise MemoryError("Unable to grow look-ahead queue")
+        # Note that a corner blend may be inserted before the move
+        moves = self.moves
+        while len(moves) <= index + 1:
+            moves.append(self.move_class(self, len(moves)))
+        return moves[index]
     def add_move(self, move):
-        self.queue.append(move)
-        if len(self.queue) == 1:
-            return
-        move.calc_junction(self.queue[-2])
-        self.junction_flush -= move.min_move_t
+        min_move_t = move.min_move_t
+        if (not self.merge_tolerance
+            or not self.moveq_merge(self.mq, self.merge_tolerance)):
+            index = self.moveq_add(self.mq)
+            if not index:
+                return
+            move.calc_junction(self.moves[index-1])
+        self.junction_flush -= min_move_t
         if self.junction_flush <= 0.:
             # Enough moves have been queued to reach the target flush time.
             self.flush(lazy=True)
 
+# Move that only accumulates its duration (no steps are generated)
+class PlannedMove(Move):
+    __slots__ = []
+    def move(self):
+        mq, index = self.mq, self.index
+        planner = self.toolhead
+        planner.print_time += (
+            mq.accel_t[index] + mq.cruise_t[index] + mq.decel_t[index])
+        planner.move_count += 1
+        planner.check_marks()
+
+# Class to plan moves with the look-ahead queue, velocity limits, and
+# kinematic limits of a toolhead without generating any steps.  This
+# is used to estimate the time needed to print a file.
+class MovePlanner:
+    def __init__(self, toolhead):
+        # Moves are not checked against the state of the printer -
+        # copies of the kinematics and extruder are used so that all
+        # axes may be treated as homed and the extruder as heated.
+        self.kin = copy.copy(toolhead.kin)
+        self.kin.set_homed_axes((0, 1, 2))
+        self.extruder = copy.copy(toolhead.extruder)
+        if hasattr(self.extruder, 'heater'):
+            self.extruder.heater = copy.copy(self.extruder.heater)
+            self.extruder.heater.can_extrude = True
+        self.step_rate_limiter = toolhead.step_rate_limiter
+        self.cmove = toolhead.cmove
+        self.move_callbacks = []
+        self.config_max_velocity = toolhead.config_max_velocity
+        self.config_max_accel = toolhead.config_max_accel
+        self.config_square_corner_velocity = (
+            toolhead.config_square_corner_velocity)
+        self.max_velocity = toolhead.max_velocity
+        self.max_accel = toolhead.max_accel
+        self.requested_accel_to_decel = toolhead.requested_accel_to_decel
+        self.square_corner_velocity = toolhead.square_corner_velocity
+        self.max_accel_to_decel = toolhead.max_accel_to_decel
+        self.junction_deviation = toolhead.junction_deviation
+        self.move_queue = MoveQueue(self, PlannedMove)
+        self.move_queue.set_extruder(self.extruder)
+        self.move_queue.set_merge_tolerance(
+            toolhead.move_queue.merge_tolerance)
+        self.move_queue.set_blend_tolerance(
+            toolhead.move_queue.mq.blend_tolerance)
+        self.move_queue.set_flush_time(toolhead.buffer_time_high)
+        self.commanded_pos = list(toolhead.commanded_pos)
+        self.print_time = 0.
+        self.move_count = 0
+        self.pending_marks = []
+        self.mark_times = []
+    def get_print_time(self):
+        self.move_queue.flush()
+        return self.print_time
+    def add_mark(self):
+        # Return an id for the time at which all moves queued so far
+        # will have completed (see get_mark_time())
+        mark_id = len(self.mark_times)
+        self.mark_times.append(None)
+        self.pending_marks.append(
+            (self.move_count + self.move_queue.mq.count, mark_id))
+        self.check_marks()
+        return mark_id
+    def check_marks(self):
+        marks = self.pending_marks
+        while marks and marks[0][0] <= self.move_count:
+            self.mark_times[marks.pop(0)[1]] = self.print_time
+    def get_mark_time(self, mark_id):
+        if self.mark_times[mark_id] is None:
+            self.move_queue.flush()
+        return self.mark_times[mark_id]
+    def get_position(self):
+        return list(self.commanded_pos)
+    def set_position(self, newpos):
+        self.move_queue.flush()
+        self.commanded_pos[:] = newpos
+    def move(self, newpos, speed):
+        move = self.move_queue.prepare_move(self.commanded_pos, newpos, speed)
+        if not move.move_d:
+            return
+        if move.is_kinematic_move:
+            self.kin.check_move(move)
+            if self.step_rate_limiter is not None:
+                self.step_rate_limiter.check_move(move)
+        if move.axes_d[3]:
+            self.extruder.check_move(move)
+        self.commanded_pos[:] = move.end_pos
+        self.move_queue.add_move(move)
+    def dwell(self, delay):
+        self.move_queue.flush()
+        self.print_time += delay
+    def set_velocity_limit(self, max_velocity=None, max_accel=None,
+                           square_corner_velocity=None, accel_to_decel=None):
+        # Equivalent of the SET_VELOCITY_LIMIT and M204 commands
+        self.move_queue.flush()
+        if max_velocity is not None:
+            self.max_velocity = min(max_velocity, self.config_max_velocity)
+        if max_accel is not None:
+            self.max_accel = min(max_accel, self.config_max_accel)
+        if square_corner_velocity is not None:
+            self.square_corner_velocity = min(
+                square_corner_velocity, self.config_square_corner_velocity)
+        if accel_to_decel is not None:
+            self.requested_accel_to_decel = accel_to_decel
+        scv2 = self.square_corner_velocity**2
+        self.junction_deviation = scv2 * (math.sqrt(2.) - 1.) / self.max_accel
+        self.max_accel_to_decel = min(self.requested_accel_to_decel,
+                                      self.max_accel)
+
 STALL_TIME = 0.100
 
+# Limit move velocity so that no stepper exceeds the step rate that
+# its micro-controller can sustain
+class StepRateLimiter:
+    def __init__(self, steppers):
+        self.steppers = []
+        self.mcu_total_rates = {}
+        for s in steppers:
+            mcu = s.get_mcu()
+            max_rate, max_total_rate = mcu.get_max_step_rate()
+            if not max_rate and not max_total_rate:
+                continue
+            self.steppers.append((s.calc_max_step_rate, mcu, max_rate))
+            self.mcu_total_rates[mcu] = max_total_rate
+    def is_active(self):
+        return not not self.steppers
+    def check_move(self, move):
+        # Peak steps per millimeter of toolhead movement
+        start_pos, end_pos = move.start_pos, move.end_pos
+        max_v2 = move.max_cruise_v2
+        mcu_step_r = {}
+        for calc_max_step_rate, mcu, max_rate in self.steppers:
+            step_r = calc_max_step_rate(start_pos, end_pos)
+            if not step_r:
+                continue
+            if max_rate:
+                max_v2 = min(max_v2, (max_rate / step_r)**2)
+            mcu_step_r[mcu] = mcu_step_r.get(mcu, 0.) + step_r
+        for mcu, step_r in mcu_step_r.items():
+            max_total_rate = self.mcu_total_rates[mcu]
+            if max_total_rate:
+                max_v2 = min(max_v2, (max_total_rate / step_r)**2)
+        if max_v2 < move.max_cruise_v2:
+            move.limit_speed(math.sqrt(max_v2), move.accel)
+
 # Main code to track events (and their timing) on the printer toolhead
 class ToolHead:
     def __init__(self, config):
@@ -202,12 +333,16 @@ class ToolHead:
         self.all_mcus = [
             m for n, m in self.printer.lookup_objects(module='mcu')]
         self.mcu = self.all_mcus[0]
-        self.move_queue = MoveQueue()
+        self.move_queue = MoveQueue(self)
         self.commanded_pos = [0., 0., 0., 0.]
         self.printer.register_event_handler("gcode:request_restart",
                                             self._handle_request_restart)
         self.printer.register_event_handler("klippy:shutdown",
                                             self._handle_shutdown)
+        self.printer.register_event_handler("klippy:connect",
+                                            self._handle_connect)
+        self.step_rate_limiter = None
+        self.move_callbacks = []
         # Velocity and acceleration control
         self.max_velocity = config.getfloat('max_velocity', above=0.)
         self.max_accel = config.getfloat('max_accel', above=0.)
@@ -219,6 +354,10 @@ class ToolHead:
         self.config_max_velocity = self.max_velocity
         self.config_max_accel = self.max_accel
         self.config_square_corner_velocity = self.square_corner_velocity
+        self.move_queue.set_merge_tolerance(config.getfloat(
+            'move_merge_tolerance', 0., minval=0.))
+        self.move_queue.set_blend_tolerance(config.getfloat(
+            'corner_blend_tolerance', 0., minval=0.))
         self.junction_deviation = 0.
         self._calc_junction_deviation()
         # Print time tracking
@@ -230,6 +369,9 @@ class ToolHead:
             'buffer_time_start', 0.250, above=0.)
         self.move_flush_time = config.getfloat(
             'move_flush_time', 0.050, above=0.)
+        move_flush_interval = config.getfloat(
+            'move_flush_interval', 0.010, minval=0.,
+            below=self.move_flush_time)
         self.print_time = 0.
         self.last_print_start_time = 0.
         self.need_check_stall = -1.
@@ -238,13 +380,14 @@ class ToolHead:
         self.idle_flush_print_time = 0.
         self.flush_timer = self.reactor.register_timer(self._flush_handler)
         self.move_queue.set_flush_time(self.buffer_time_high)
+        for m in self.all_mcus:
+            m.setup_flush_interval(move_flush_interval)
         self.printer.try_load_module(config, "idle_timeout")
         self.printer.try_load_module(config, "statistics")
         self.printer.try_load_module(config, "manual_probe")
         # Setup iterative solver
         ffi_main, ffi_lib = chelper.get_ffi()
         self.cmove = ffi_main.gc(ffi_lib.move_alloc(), ffi_lib.free)
-        self.move_fill = ffi_lib.move_fill
         # Create kinematics class
         self.extruder = kinematics.extruder.DummyExtruder()
         self.move_queue.set_extruder(self.extruder)
@@ -271,7 +414,7 @@ class ToolHead:
         self.print_time += movetime
         flush_to_time = self.print_time - self.move_flush_time
         for m in self.all_mcus:
-            m.flush_moves(flush_to_time)
+            m.flush_moves(flush_to_time, lazy=True)
     def _calc_print_time(self):
         curtime = self.reactor.monotonic()
         est_print_time = self.mcu.estimated_print_time(curtime)
@@ -352,11 +495,13 @@ class ToolHead:
         self.commanded_pos[:] = newpos
         self.kin.set_position(newpos, homing_axes)
     def move(self, newpos, speed):
-        move = Move(self, self.commanded_pos, newpos, speed)
+        move = self.move_queue.prepare_move(self.commanded_pos, newpos, speed)
         if not move.move_d:
             return
         if move.is_kinematic_move:
             self.kin.check_move(move)
+            if self.step_rate_limiter is not None:
+                self.step_rate_limiter.check_move(move)
         if move.axes_d[3]:
             self.extruder.check_move(move)
         self.commanded_pos[:] = move.end_pos
@@ -404,7 +549,7 @@ class ToolHead:
             self.print_time, max(buffer_time, 0.), self.print_stall)
     def check_busy(self, eventtime):
         est_print_time = self.mcu.estimated_print_time(eventtime)
-        lookahead_empty = not self.move_queue.queue
+        lookahead_empty = self.move_queue.is_empty()
         return self.print_time, est_print_time, lookahead_empty
     def get_status(self, eventtime):
         print_time = self.print_time
@@ -418,6 +563,10 @@ class ToolHead:
         return { 'status': status, 'print_time': print_time,
                  'estimated_print_time': estimated_print_time,
                  'printing_time': print_time - last_print_start_time }
+    def _handle_connect(self):
+        limiter = StepRateLimiter(self.kin.get_steppers())
+        if limiter.is_active():
+            self.step_rate_limiter = limiter
     def _handle_request_restart(self, print_time):
         self.motor_off()
     def _handle_shutdown(self):
@@ -425,6 +574,17 @@ class ToolHead:
         self.reset_print_time()
     def get_kinematics(self):
         return self.kin
+    def get_planner(self):
+        return MovePlanner(self)
+    def register_move_callback(self, cb):
+        # Invoke cb(print_time, move) before the steps of each
+        # kinematic move are generated
+        self.move_callbacks.append(cb)
+    def get_move_sequence(self):
+        # Return the Move.sequence of the next move to be queued.  This
+        # allows a setting to change at that move without waiting for
+        # the look-ahead queue to be flushed.
+        return self.move_queue.get_next_sequence()
     def get_max_velocity(self):
         return self.max_velocity, self.max_accel
     def get_max_axis_halt(self):
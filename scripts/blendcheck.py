@@ -0,0 +1,167 @@
+#!/usr/bin/env python2
+# Check the path deviation and acceleration of corner blends
+#
+# Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import sys, os, optparse, math
+sys.path.append(os.path.join(os.path.dirname(__file__), '../klippy'))
+import chelper
+
+SAMPLES = 1000
+CHECK_TOLERANCE = 1.000001
+
+# Plan a move from the origin to 'corner' and then on to 'end_pos'.
+# Returns the planned moves as a list of dictionaries.
+def plan_corner(options, blend_tolerance, corner, end_pos):
+    ffi_main, ffi_lib = chelper.get_ffi()
+    mq = ffi_main.gc(ffi_lib.moveq_alloc(), ffi_lib.moveq_free)
+    ffi_lib.moveq_set_blend_tolerance(mq, blend_tolerance)
+    scv2 = options.square_corner_velocity**2
+    junction_deviation = scv2 * (math.sqrt(2.) - 1.) / options.accel
+    start_pos = [0., 0., 0., 0.]
+    for pos in [corner, end_pos]:
+        index = ffi_lib.moveq_prepare(
+            mq, start_pos, pos, options.velocity, options.velocity,
+            options.accel, options.accel_to_decel)
+        if index < 0:
+            raise MemoryError("Unable to grow look-ahead queue")
+        index = ffi_lib.moveq_add(mq)
+        if index:
+            ffi_lib.moveq_calc_junction(mq, index, 99999999.9,
+                                        junction_deviation)
+        start_pos = pos
+    flush_count = ffi_lib.moveq_plan(mq, 0)
+    moves = []
+    for i in range(flush_count):
+        move = {}
+        for name in ['is_blend', 'move_d', 'accel', 'accel_t', 'cruise_t',
+                     'decel_t', 'start_v', 'cruise_v', 'end_v']:
+            move[name] = getattr(mq, name)[i]
+        move['start_pos'] = mq.start_pos[i*4:i*4+3]
+        move['axes_d'] = mq.axes_d[i*4:i*4+3]
+        move['start_r'] = mq.blend_start_r[i*3:i*3+3]
+        move['end_r'] = mq.blend_end_r[i*3:i*3+3]
+        moves.append(move)
+    return moves
+
+# Return the position, first derivative, and second derivative of a
+# move's path at distance 'd' (see move_get_coord())
+def eval_path(move, d):
+    sp = move['start_pos']
+    if not move['is_blend']:
+        inv_move_d = 1. / move['move_d']
+        axes_r = [a * inv_move_d for a in move['axes_d']]
+        return ([s + r * d for s, r in zip(sp, axes_r)], axes_r, [0.] * 3)
+    start_r, end_r = move['start_r'], move['end_r']
+    c2 = [.5 / move['move_d'] * (e - s) for s, e in zip(start_r, end_r)]
+    return ([s + r * d + c * d * d for s, r, c in zip(sp, start_r, c2)],
+            [r + 2. * c * d for r, c in zip(start_r, c2)],
+            [2. * c for c in c2])
+
+# Return the distance, velocity, and tangential acceleration of a
+# move at time 't'
+def eval_trapezoid(move, t):
+    accel, start_v, cruise_v = move['accel'], move['start_v'], move['cruise_v']
+    accel_t, cruise_t = move['accel_t'], move['cruise_t']
+    if t < accel_t:
+        return start_v * t + .5 * accel * t * t, start_v + accel * t, accel
+    accel_d = (start_v + cruise_v) * .5 * accel_t
+    t -= accel_t
+    if t < cruise_t:
+        return accel_d + cruise_v * t, cruise_v, 0.
+    t -= cruise_t
+    return (accel_d + cruise_v * cruise_t + cruise_v * t - .5 * accel * t * t,
+            cruise_v - accel * t, -accel)
+
+def vec_len(v):
+    return math.sqrt(sum([c * c for c in v]))
+
+def check_corner(options):
+    angle = math.radians(options.angle)
+    length = options.length
+    start_length = options.start_length or length
+    corner = [start_length, 0., 0., 0.]
+    end_pos = [start_length + length * math.cos(angle),
+               length * math.sin(angle), 0., 0.]
+    moves = plan_corner(options, options.tolerance, corner, end_pos)
+    ref_moves = plan_corner(options, 0., corner, end_pos)
+    total_t = sum([m['accel_t'] + m['cruise_t'] + m['decel_t']
+                   for m in moves])
+    ref_t = sum([m['accel_t'] + m['cruise_t'] + m['decel_t']
+                 for m in ref_moves])
+    # Sample the path of each move
+    errors = []
+    max_accel = max_dev = 0.
+    prev_end_v = 0.
+    prev_end_pos = [0., 0., 0.]
+    for i, move in enumerate(moves):
+        if abs(move['start_v'] - prev_end_v) > .000001:
+            errors.append("Move %d starts at %.6f (previous ends at %.6f)" % (
+                i, move['start_v'], prev_end_v))
+        if vec_len([s - p for s, p in zip(move['start_pos'],
+                                           prev_end_pos)]) > .000001:
+            errors.append("Move %d does not start at the previous end" % (
+                i,))
+        prev_end_v = move['end_v']
+        prev_end_pos = eval_path(move, move['move_d'])[0]
+        move_t = move['accel_t'] + move['cruise_t'] + move['decel_t']
+        min_dist = None
+        for j in range(SAMPLES + 1):
+            d, v, a_t = eval_trapezoid(move, move_t * j / SAMPLES)
+            pos, dpos, ddpos = eval_path(move, d)
+            accel = vec_len([dd * v * v + dp * a_t
+                             for dp, dd in zip(dpos, ddpos)])
+            max_accel = max(max_accel, accel)
+            if accel > options.accel * CHECK_TOLERANCE:
+                errors.append("Move %d accel %.3f at t=%.6f" % (
+                    i, accel, move_t * j / SAMPLES))
+            dist = vec_len([p - c for p, c in zip(pos, corner)])
+            if min_dist is None or dist < min_dist:
+                min_dist = dist
+        if move['is_blend']:
+            max_dev = max(max_dev, min_dist)
+            if min_dist > options.tolerance * CHECK_TOLERANCE:
+                errors.append("Blend %d deviates %.6f from the corner" % (
+                    i, min_dist))
+    if prev_end_v:
+        errors.append("Last move ends at %.6f" % (prev_end_v,))
+    blends = len([m for m in moves if m['is_blend']])
+    sys.stdout.write(
+        "%.1f degree corner, %d blend(s), tolerance %.3f\n"
+        "  max deviation: %.6f\n"
+        "  max acceleration: %.3f (limit %.3f)\n"
+        "  move time: %.6f (%.6f without blending)\n" % (
+            options.angle, blends, options.tolerance, max_dev,
+            max_accel, options.accel, total_t, ref_t))
+    for error in errors[:10]:
+        sys.stdout.write("ERROR: %s\n" % (error,))
+    return not errors
+
+def main():
+    usage = "%prog [options]"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-t", "--tolerance", type="float", dest="tolerance",
+                    default=.5, help="corner_blend_tolerance (mm)")
+    opts.add_option("-a", "--angle", type="float", dest="angle",
+                    default=90., help="change in direction at the corner")
+    opts.add_option("-l", "--length", type="float", dest="length",
+                    default=20., help="length of each move (mm)")
+    opts.add_option("-s", "--start-length", type="float", dest="start_length",
+                    help="length of the move before the corner (mm)")
+    opts.add_option("-v", "--velocity", type="float", dest="velocity",
+                    default=200., help="max_velocity (mm/s)")
+    opts.add_option("--accel", type="float", dest="accel",
+                    default=3000., help="max_accel (mm/s^2)")
+    opts.add_option("--accel-to-decel", type="float", dest="accel_to_decel",
+                    default=1500., help="max_accel_to_decel (mm/s^2)")
+    opts.add_option("--scv", type="float", dest="square_corner_velocity",
+                    default=5., help="square_corner_velocity (mm/s)")
+    options, args = opts.parse_args()
+    if args:
+        opts.error("Incorrect number of arguments")
+    if not check_corner(options):
+        sys.exit(-1)
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,30 @@
+#!/usr/bin/env python2
+# Convert a g-code file to the pre-parsed binary form used by virtual_sdcard
+#
+# Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import sys, os, optparse
+sys.path.append(os.path.join(os.path.dirname(__file__), '../klippy'))
+sys.path.append(os.path.join(os.path.dirname(__file__), '../klippy/extras'))
+import virtual_sdcard
+
+def main():
+    usage = "%prog [options] <input.gcode> [<output.kgc>]"
+    opts = optparse.OptionParser(usage)
+    options, args = opts.parse_args()
+    if len(args) not in (1, 2):
+        opts.error("Incorrect number of arguments")
+    infilename = args[0]
+    if len(args) == 2:
+        outfilename = args[1]
+    else:
+        outfilename = os.path.splitext(infilename)[0] + '.kgc'
+    infile = open(infilename, 'rb')
+    outfile = open(outfilename, 'wb')
+    virtual_sdcard.convert_gcode(infile, outfile)
+    outfile.close()
+    infile.close()
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,96 @@
+#!/usr/bin/env python2
+# Benchmark the memory use and first step latency of host step generation
+#
+# Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import sys, os, optparse, time
+sys.path.append(os.path.join(os.path.dirname(__file__), '../klippy'))
+import chelper
+
+FLUSH_INTERVAL = 0.010
+
+def get_rss():
+    # Return the resident memory of this process (in bytes)
+    f = open('/proc/self/statm', 'rb')
+    rss = int(f.read().split()[1])
+    f.close()
+    return rss * os.sysconf('SC_PAGE_SIZE')
+
+def run_bench(options):
+    ffi_main, ffi_lib = chelper.get_ffi()
+    freq = options.freq
+    # Setup steppers that transmit to /dev/null
+    devnull = open(os.devnull, 'wb')
+    sq = ffi_lib.serialqueue_alloc(devnull.fileno(), 1)
+    sc_list, sk_list = [], []
+    for i in range(options.steppers):
+        sc = ffi_lib.stepcompress_alloc(i)
+        ffi_lib.stepcompress_fill(sc, int(.000025 * freq), 0, 1, 2)
+        sk = ffi_lib.cartesian_stepper_alloc('x')
+        ffi_lib.itersolve_set_stepcompress(sk, sc, options.step_dist)
+        sc_list.append(sc)
+        sk_list.append(sk)
+    ss = ffi_lib.steppersync_alloc(
+        sq, ffi_main.new('struct stepcompress *[]', sc_list),
+        len(sc_list), 16)
+    ffi_lib.steppersync_set_time(ss, 0., freq)
+    ffi_lib.steppersync_set_flush_interval(ss, int(FLUSH_INTERVAL * freq))
+    cmove = ffi_lib.move_alloc()
+    # Queue moves in one direction (a direction change would flush
+    # the step queue) for the full look-ahead buffer time and then
+    # transmit the first flush interval of steps
+    velocity = options.velocity
+    move_t = options.distance / velocity
+    start_rss = get_rss()
+    start_time = time.time()
+    print_time = start_x = 0.
+    while print_time < options.buffer_time:
+        ffi_lib.move_fill(cmove, print_time, 0., move_t, 0.,
+                          start_x, 0., 0., 1., 0., 0.,
+                          velocity, velocity, 0.)
+        for sk in sk_list:
+            ffi_lib.itersolve_queue_move(sk, cmove)
+            if options.eager:
+                # Behavior prior to deferred step generation
+                ffi_lib.itersolve_generate_steps(sk, float('inf'))
+        print_time += move_t
+        start_x += options.distance
+    ret = ffi_lib.steppersync_flush(ss, int(FLUSH_INTERVAL * freq))
+    first_step_time = time.time() - start_time
+    mem = get_rss() - start_rss
+    if ret:
+        sys.stderr.write("Error in step generation\n")
+        sys.exit(-1)
+    mode = "eager" if options.eager else "deferred"
+    sys.stdout.write("%s: %d steppers, %.0f steps/s, %.1fs buffer\n"
+                     "  memory per stepper: %.1f KiB\n"
+                     "  time to first flush: %.1f ms\n" % (
+                         mode, options.steppers, velocity / options.step_dist,
+                         options.buffer_time, mem / 1024. / options.steppers,
+                         first_step_time * 1000.))
+
+def main():
+    usage = "%prog [options]"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-n", "--steppers", type="int", dest="steppers",
+                    default=4, help="number of steppers")
+    opts.add_option("-t", "--buffer-time", type="float", dest="buffer_time",
+                    default=2., help="seconds of moves to queue")
+    opts.add_option("-v", "--velocity", type="float", dest="velocity",
+                    default=200., help="move velocity (mm/s)")
+    opts.add_option("-d", "--distance", type="float", dest="distance",
+                    default=20., help="move distance (mm)")
+    opts.add_option("-s", "--step-distance", type="float", dest="step_dist",
+                    default=.0025, help="stepper step_distance (mm)")
+    opts.add_option("-f", "--freq", type="float", dest="freq",
+                    default=72000000., help="micro-controller clock rate")
+    opts.add_option("-e", "--eager", action="store_true", dest="eager",
+                    help="generate all steps as soon as a move is queued")
+    options, args = opts.parse_args()
+    if args:
+        opts.error("Incorrect number of arguments")
+    run_bench(options)
+
+if __name__ == '__main__':
+    main()
@@ -15,18 +15,24 @@ struct end_stop {
     struct timer time;
     struct gpio_in pin;
     uint32_t rest_time, sample_time, nextwake;
+    // Homing program (retract and second approach run by the mcu)
+    uint32_t program_delay, retract_interval, approach_interval;
+    uint16_t retract_count, approach_count;
     uint8_t flags, stepper_count, sample_count, trigger_count;
     struct stepper *steppers[0];
 };
 
-enum { ESF_PIN_HIGH=1<<0, ESF_HOMING=1<<1, ESF_REPORT=1<<2 };
+enum {
+    ESF_PIN_HIGH=1<<0, ESF_HOMING=1<<1, ESF_REPORT=1<<2, ESF_PROGRAM=1<<3,
+    ESF_RETRACT_ERROR=1<<4
+};
 
 static struct task_wake endstop_wake;
 
 static void
 stop_steppers(struct end_stop *e)
 {
-    e->flags = ESF_REPORT;
+    e->flags = ESF_REPORT | (e->flags & ESF_RETRACT_ERROR);
     uint8_t count = e->stepper_count;
     while (count--)
         if (e->steppers[count])
@@ -34,8 +40,47 @@ stop_steppers(struct end_stop *e)
     sched_wake_task(&endstop_wake);
 }
 
+static uint_fast8_t end_stop_event(struct timer *t);
 static uint_fast8_t end_stop_oversample_event(struct timer *t);
 
+// Timer callback at the start of a homing program's second approach
+static uint_fast8_t
+end_stop_approach_event(struct timer *t)
+{
+    struct end_stop *e = container_of(t, struct end_stop, time);
+    uint8_t val = gpio_in_read(e->pin);
+    if (!((val ? ~e->flags : e->flags) & ESF_PIN_HIGH)) {
+        // Endstop still triggered after the retract
+        e->flags |= ESF_RETRACT_ERROR;
+        stop_steppers(e);
+        return SF_DONE;
+    }
+    e->time.func = end_stop_event;
+    e->time.waketime += e->rest_time;
+    return SF_RESCHEDULE;
+}
+
+// Start the retract and second approach of a homing program
+static uint_fast8_t
+start_program(struct end_stop *e)
+{
+    uint32_t start_time = e->time.waketime + e->program_delay;
+    uint8_t count = e->stepper_count;
+    while (count--)
+        if (e->steppers[count])
+            stepper_home_program(
+                e->steppers[count], start_time
+                , e->retract_interval, e->retract_count
+                , e->approach_interval, e->approach_count);
+    e->flags &= ~ESF_PROGRAM;
+    e->rest_time = e->approach_interval;
+    e->trigger_count = e->sample_count;
+    e->time.func = end_stop_approach_event;
+    e->time.waketime = (start_time
+                        + e->retract_interval * e->retract_count);
+    return SF_RESCHEDULE;
+}
+
 // Timer callback for an end stop
 static uint_fast8_t
 end_stop_event(struct timer *t)
@@ -68,6 +113,8 @@ end_stop_oversample_event(struct timer *t)
     }
     uint8_t count = e->trigger_count - 1;
     if (!count) {
+        if (e->flags & ESF_PROGRAM)
+            return start_program(e);
         stop_steppers(e);
         return SF_DONE;
     }
@@ -126,14 +173,39 @@ DECL_COMMAND(command_end_stop_home,
              "end_stop_home oid=%c clock=%u sample_ticks=%u sample_count=%c"
              " rest_ticks=%u pin_value=%c");
 
+// Have the mcu perform the retract and second approach of the
+// current homing operation
+void
+command_end_stop_home_program(uint32_t *args)
+{
+    struct end_stop *e = oid_lookup(args[0], command_config_end_stop);
+    irq_disable();
+    if (!(e->flags & ESF_HOMING) || e->flags & ESF_REPORT) {
+        irq_enable();
+        shutdown("Homing program without active homing");
+    }
+    e->program_delay = args[1];
+    e->retract_interval = args[2];
+    e->retract_count = args[3];
+    e->approach_interval = args[4];
+    e->approach_count = args[5];
+    e->flags |= ESF_PROGRAM;
+    irq_enable();
+}
+DECL_COMMAND(command_end_stop_home_program,
+             "end_stop_home_program oid=%c delay_ticks=%u retract_ticks=%u"
+             " retract_count=%hu approach_ticks=%u approach_count=%hu");
+
 static void
 end_stop_report(uint8_t oid, struct end_stop *e)
 {
     irq_disable();
     uint8_t eflags = e->flags;
-    e->flags &= ~ESF_REPORT;
+    e->flags &= ~(ESF_REPORT | ESF_RETRACT_ERROR);
     irq_enable();
 
+    if (eflags & ESF_RETRACT_ERROR)
+        sendf("end_stop_retract_error oid=%c", oid);
     sendf("end_stop_state oid=%c homing=%c pin_value=%c"
           , oid, !!(eflags & ESF_HOMING), gpio_in_read(e->pin));
 }
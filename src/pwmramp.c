@@ -0,0 +1,147 @@
+// Hardware pwm output with a queue of timed linear ramps
+//
+// Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include "basecmd.h" // oid_alloc
+#include "board/gpio.h" // struct gpio_pwm
+#include "board/irq.h" // irq_disable
+#include "command.h" // DECL_COMMAND
+#include "sched.h" // sched_add_timer
+
+// Each ramp writes 'count' values - the first at 'clock' and then
+// one every 'interval' ticks with 'add' applied to the value between
+// writes.  Values are in 16.16 fixed point.
+struct pwm_ramp_move {
+    struct pwm_ramp_move *next;
+    uint32_t clock, interval, value;
+    int32_t add;
+    uint16_t count;
+};
+
+struct pwm_ramp {
+    struct timer timer;
+    struct gpio_pwm pin;
+    uint32_t interval, value, max_duration;
+    int32_t add;
+    uint16_t count, default_value;
+    struct pwm_ramp_move *first, **plast;
+};
+
+// Setup the next ramp in the queue
+static uint_fast8_t
+pwm_ramp_load_next(struct pwm_ramp *r)
+{
+    struct pwm_ramp_move *m = r->first;
+    if (!m)
+        return SF_DONE;
+    r->timer.waketime = m->clock;
+    r->interval = m->interval;
+    r->value = m->value;
+    r->add = m->add;
+    r->count = m->count;
+    r->first = m->next;
+    move_free(m);
+    return SF_RESCHEDULE;
+}
+
+static uint_fast8_t pwm_ramp_event(struct timer *timer);
+
+// No ramp was queued within max_duration of the end of the last ramp
+static uint_fast8_t
+pwm_ramp_end_event(struct timer *timer)
+{
+    struct pwm_ramp *r = container_of(timer, struct pwm_ramp, timer);
+    gpio_pwm_write(r->pin, r->default_value);
+    r->timer.func = pwm_ramp_event;
+    return SF_DONE;
+}
+
+static uint_fast8_t
+pwm_ramp_event(struct timer *timer)
+{
+    struct pwm_ramp *r = container_of(timer, struct pwm_ramp, timer);
+    uint16_t value = r->value >> 16;
+    gpio_pwm_write(r->pin, value);
+    uint_fast16_t count = r->count - 1;
+    if (likely(count)) {
+        r->count = count;
+        r->value += r->add;
+        r->timer.waketime += r->interval;
+        return SF_RESCHEDULE;
+    }
+    r->count = 0;
+    if (r->first)
+        return pwm_ramp_load_next(r);
+    if (value == r->default_value || !r->max_duration)
+        return SF_DONE;
+    // Return to the default value if the host stops sending ramps
+    r->timer.waketime += r->interval + r->max_duration;
+    r->timer.func = pwm_ramp_end_event;
+    return SF_RESCHEDULE;
+}
+
+void
+command_config_pwm_ramp(uint32_t *args)
+{
+    struct gpio_pwm pin = gpio_pwm_setup(args[1], args[2], args[3]);
+    struct pwm_ramp *r = oid_alloc(args[0], command_config_pwm_ramp
+                                   , sizeof(*r));
+    r->pin = pin;
+    r->default_value = args[3];
+    r->max_duration = args[4];
+    r->timer.func = pwm_ramp_event;
+    move_request_size(sizeof(struct pwm_ramp_move));
+}
+DECL_COMMAND(command_config_pwm_ramp,
+             "config_pwm_ramp oid=%c pin=%u cycle_ticks=%u default_value=%hu"
+             " max_duration=%u");
+
+void
+command_queue_pwm_ramp(uint32_t *args)
+{
+    struct pwm_ramp *r = oid_lookup(args[0], command_config_pwm_ramp);
+    struct pwm_ramp_move *m = move_alloc();
+    m->clock = args[1];
+    m->interval = args[2];
+    m->count = args[3];
+    if (!m->count)
+        shutdown("Invalid count parameter");
+    m->value = args[4];
+    m->add = args[5];
+    m->next = NULL;
+
+    irq_disable();
+    if (r->count) {
+        if (r->first)
+            *r->plast = m;
+        else
+            r->first = m;
+        r->plast = &m->next;
+    } else {
+        // Cancel any pending return to the default value
+        sched_del_timer(&r->timer);
+        r->timer.func = pwm_ramp_event;
+        r->first = m;
+        pwm_ramp_load_next(r);
+        sched_add_timer(&r->timer);
+    }
+    irq_enable();
+}
+DECL_COMMAND(command_queue_pwm_ramp,
+             "queue_pwm_ramp oid=%c clock=%u interval=%u count=%hu"
+             " value=%u add=%i");
+
+void
+pwm_ramp_shutdown(void)
+{
+    uint8_t i;
+    struct pwm_ramp *r;
+    foreach_oid(i, r, command_config_pwm_ramp) {
+        gpio_pwm_write(r->pin, r->default_value);
+        r->first = NULL;
+        r->count = 0;
+    }
+}
+DECL_SHUTDOWN(pwm_ramp_shutdown);
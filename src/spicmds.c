@@ -7,6 +7,7 @@
 #include <string.h> // memcpy
 #include "autoconf.h" // CONFIG_HAVE_GPIO_BITBANGING
 #include "board/gpio.h" // gpio_out_write
+#include "board/irq.h" // irq_disable
 #include "basecmd.h" // oid_alloc
 #include "command.h" // DECL_COMMAND
 #include "sched.h" // DECL_SHUTDOWN
@@ -14,20 +15,24 @@
 #include "spicmds.h" // spidev_transfer
 
 struct spidev_s {
+    struct timer timer;
     union {
         struct spi_config spi_config;
         struct spi_software *spi_software;
     };
     struct gpio_out pin;
     uint8_t flags;
+    uint8_t sched_len, sched_data[8];
     uint8_t shutdown_msg_len;
     uint8_t shutdown_msg[];
 };
 
 enum {
-    SF_HAVE_PIN = 1, SF_SOFTWARE = 2,
+    SF_HAVE_PIN = 1, SF_SOFTWARE = 2, SF_SCHEDULED = 4, SF_SEND_PENDING = 8,
 };
 
+static struct task_wake spidev_wake;
+
 void
 command_config_spi(uint32_t *args)
 {
@@ -134,6 +139,56 @@ command_spi_send(uint32_t *args)
 }
 DECL_COMMAND(command_spi_send, "spi_send oid=%c data=%*s");
 
+// Timer callback - note that a scheduled transmission is due
+static uint_fast8_t
+spidev_scheduled_event(struct timer *timer)
+{
+    struct spidev_s *spi = container_of(timer, struct spidev_s, timer);
+    spi->flags = (spi->flags & ~SF_SCHEDULED) | SF_SEND_PENDING;
+    sched_wake_task(&spidev_wake);
+    return SF_DONE;
+}
+
+void
+command_spi_schedule_send(uint32_t *args)
+{
+    uint8_t oid = args[0];
+    struct spidev_s *spi = oid_lookup(oid, command_config_spi);
+    uint8_t data_len = args[2];
+    uint8_t *data = (void*)(size_t)args[3];
+    if (data_len > sizeof(spi->sched_data))
+        shutdown("spi scheduled send too large");
+    if (spi->flags & (SF_SCHEDULED | SF_SEND_PENDING))
+        shutdown("spi scheduled send already pending");
+    memcpy(spi->sched_data, data, data_len);
+    spi->sched_len = data_len;
+    spi->flags |= SF_SCHEDULED;
+    spi->timer.func = spidev_scheduled_event;
+    spi->timer.waketime = args[1];
+    sched_add_timer(&spi->timer);
+}
+DECL_COMMAND(command_spi_schedule_send,
+             "spi_schedule_send oid=%c clock=%u data=%*s");
+
+// Perform any scheduled transmissions that are now due
+void
+spidev_task(void)
+{
+    if (!sched_check_wake(&spidev_wake))
+        return;
+    uint8_t oid;
+    struct spidev_s *spi;
+    foreach_oid(oid, spi, command_config_spi) {
+        if (!(spi->flags & SF_SEND_PENDING))
+            continue;
+        irq_disable();
+        spi->flags &= ~SF_SEND_PENDING;
+        irq_enable();
+        spidev_transfer(spi, 0, spi->sched_len, spi->sched_data);
+    }
+}
+DECL_TASK(spidev_task);
+
 void
 spidev_shutdown(void)
 {
@@ -141,6 +196,7 @@ spidev_shutdown(void)
     uint8_t oid;
     struct spidev_s *spi;
     foreach_oid(oid, spi, command_config_spi) {
+        spi->flags &= ~(SF_SCHEDULED | SF_SEND_PENDING);
         if (spi->flags & SF_HAVE_PIN)
             gpio_out_write(spi->pin, 1);
     }
@@ -53,7 +53,8 @@ enum { POSITION_BIAS=0x40000000 };
 
 enum {
     SF_LAST_DIR=1<<0, SF_NEXT_DIR=1<<1, SF_INVERT_STEP=1<<2, SF_HAVE_ADD=1<<3,
-    SF_LAST_RESET=1<<4, SF_NO_NEXT_CHECK=1<<5, SF_NEED_RESET=1<<6
+    SF_LAST_RESET=1<<4, SF_NO_NEXT_CHECK=1<<5, SF_NEED_RESET=1<<6,
+    SF_PROGRAM=1<<7
 };
 
 // Setup a stepper for the next move in its queue
@@ -213,6 +214,12 @@ command_queue_step(uint32_t *args)
 
     irq_disable();
     uint8_t flags = s->flags;
+    if (flags & SF_PROGRAM) {
+        // Stepper is running an mcu homing program - discard host moves
+        move_free(m);
+        irq_enable();
+        return;
+    }
     if (!!(flags & SF_LAST_DIR) != !!(flags & SF_NEXT_DIR)) {
         flags ^= SF_LAST_DIR;
         m->flags |= MF_DIR;
@@ -262,7 +269,7 @@ command_reset_step_clock(uint32_t *args)
     if (s->count)
         shutdown("Can't reset time when stepper active");
     s->next_step_time = waketime;
-    s->flags = (s->flags & ~SF_NEED_RESET) | SF_LAST_RESET;
+    s->flags = (s->flags & ~(SF_NEED_RESET | SF_PROGRAM)) | SF_LAST_RESET;
     irq_enable();
 }
 DECL_COMMAND(command_reset_step_clock, "reset_step_clock oid=%c clock=%u");
@@ -313,6 +320,52 @@ stepper_stop(struct stepper *s)
     }
 }
 
+// Append a constant rate move to a stepper's queue.  IRQs must be off.
+static void
+stepper_queue_const(struct stepper *s, uint32_t interval, uint16_t count
+                    , uint8_t dir)
+{
+    if (!count)
+        return;
+    struct stepper_move *m = move_alloc();
+    m->interval = interval;
+    m->count = count;
+    m->add = 0;
+    m->next = NULL;
+    m->flags = 0;
+    if (!!(s->flags & SF_LAST_DIR) != dir) {
+        s->flags ^= SF_LAST_DIR;
+        m->flags |= MF_DIR;
+    }
+    if (s->count) {
+        if (s->first)
+            *s->plast = m;
+        else
+            s->first = m;
+        s->plast = &m->next;
+    } else {
+        s->first = m;
+        stepper_load_next(s, s->next_step_time + m->interval);
+        sched_add_timer(&s->time);
+    }
+}
+
+// Stop a stepper, retract it, and then approach again at a constant
+// rate (used by endstop homing programs).  IRQs must be off.
+void
+stepper_home_program(struct stepper *s, uint32_t clock
+                     , uint32_t retract_interval, uint16_t retract_count
+                     , uint32_t approach_interval, uint16_t approach_count)
+{
+    uint8_t dir = !!(s->flags & SF_LAST_DIR);
+    stepper_stop(s);
+    s->next_step_time = clock;
+    s->flags = ((s->flags & ~SF_NEED_RESET)
+                | SF_LAST_RESET | SF_NO_NEXT_CHECK | SF_PROGRAM);
+    stepper_queue_const(s, retract_interval, retract_count, !dir);
+    stepper_queue_const(s, approach_interval, approach_count, dir);
+}
+
 void
 stepper_shutdown(void)
 {
@@ -6,5 +6,9 @@
 uint_fast8_t stepper_event(struct timer *t);
 struct stepper *stepper_oid_lookup(uint8_t oid);
 void stepper_stop(struct stepper *s);
+void stepper_home_program(struct stepper *s, uint32_t clock
+                          , uint32_t retract_interval, uint16_t retract_count
+                          , uint32_t approach_interval
+                          , uint16_t approach_count);
 
 #endif // stepper.h
@@ -13,18 +13,20 @@
 #include "sched.h" // DECL_SHUTDOWN
 
 struct tmcuart_s {
-    struct timer timer;
+    struct timer timer, sched_timer;
     struct gpio_out tx_pin;
     struct gpio_in rx_pin;
     uint8_t flags;
     uint8_t pos, read_count, write_count;
     uint32_t cfg_bit_time, bit_time;
     uint8_t data[10];
+    uint8_t sched_len, sched_data[10];
 };
 
 enum {
     TU_LINE_HIGH = 1<<0, TU_ACTIVE = 1<<1, TU_READ_SYNC = 1<<2,
-    TU_REPORT = 1<<3, TU_PULLUP = 1<<4, TU_SINGLE_WIRE = 1<<5
+    TU_REPORT = 1<<3, TU_PULLUP = 1<<4, TU_SINGLE_WIRE = 1<<5,
+    TU_NO_REPORT = 1<<6, TU_SEND_PENDING = 1<<7
 };
 
 static struct task_wake tmcuart_wake;
@@ -37,16 +39,20 @@ tmcuart_reset_line(struct tmcuart_s *t)
         gpio_out_reset(t->tx_pin, 1);
     else
         gpio_out_write(t->tx_pin, 1);
-    t->flags = (t->flags & (TU_PULLUP | TU_SINGLE_WIRE)) | TU_LINE_HIGH;
+    t->flags = ((t->flags & (TU_PULLUP | TU_SINGLE_WIRE | TU_SEND_PENDING))
+                | TU_LINE_HIGH);
 }
 
 // Helper function to end a transmission and schedule a response
 static uint_fast8_t
 tmcaurt_finalize(struct tmcuart_s *t)
 {
+    uint8_t no_report = t->flags & TU_NO_REPORT;
     tmcuart_reset_line(t);
-    t->flags |= TU_REPORT;
-    sched_wake_task(&tmcuart_wake);
+    if (!no_report)
+        t->flags |= TU_REPORT;
+    if (!no_report || t->flags & TU_SEND_PENDING)
+        sched_wake_task(&tmcuart_wake);
     return SF_DONE;
 }
 
@@ -186,22 +192,15 @@ DECL_COMMAND(command_config_tmcuart,
              "config_tmcuart oid=%c rx_pin=%u pull_up=%c"
              " tx_pin=%u bit_time=%u");
 
-// Parse and schedule a TMC UART transmission request
-void
-command_tmcuart_send(uint32_t *args)
+// Setup a TMC UART transmission starting at the given time
+static void
+tmcuart_start(struct tmcuart_s *t, uint8_t write_len, uint8_t *write
+              , uint8_t read_len, uint8_t flags, uint32_t waketime)
 {
-    struct tmcuart_s *t = oid_lookup(args[0], command_config_tmcuart);
-    if (t->flags & TU_ACTIVE)
-        // Uart is busy - silently drop this request (host should retransmit)
-        return;
-    uint8_t write_len = args[1];
-    uint8_t *write = (void*)(size_t)args[2];
-    uint8_t read_len = args[3];
     if (write_len > sizeof(t->data) || read_len > sizeof(t->data))
         shutdown("tmcuart data too large");
     memcpy(t->data, write, write_len);
     t->pos = 0;
-    t->flags = (t->flags & (TU_LINE_HIGH|TU_PULLUP|TU_SINGLE_WIRE)) | TU_ACTIVE;
     t->write_count = write_len * 8;
     t->read_count = read_len * 8;
     if (write_len >= 1 && (t->data[0] & 0x3f) == 0x2a) {
@@ -211,12 +210,70 @@ command_tmcuart_send(uint32_t *args)
         t->timer.func = tmcuart_send_event;
     }
     irq_disable();
-    t->timer.waketime = timer_read_time() + timer_from_us(200);
+    t->flags = ((t->flags & (TU_LINE_HIGH | TU_PULLUP | TU_SINGLE_WIRE
+                             | TU_SEND_PENDING)) | TU_ACTIVE | flags);
+    t->timer.waketime = waketime;
     sched_add_timer(&t->timer);
     irq_enable();
 }
+
+// Parse and schedule a TMC UART transmission request
+void
+command_tmcuart_send(uint32_t *args)
+{
+    struct tmcuart_s *t = oid_lookup(args[0], command_config_tmcuart);
+    if (t->flags & (TU_ACTIVE | TU_SEND_PENDING))
+        // Uart is busy - silently drop this request (host should retransmit)
+        return;
+    uint8_t write_len = args[1];
+    uint8_t *write = (void*)(size_t)args[2];
+    uint8_t read_len = args[3];
+    uint32_t waketime = timer_read_time() + timer_from_us(200);
+    if (t->sched_len) {
+        // Don't delay a scheduled write - allow for the transmission
+        // and the longest wait for a response
+        uint32_t end_time = waketime + (((write_len + read_len) * 8 + 68)
+                                        * t->cfg_bit_time);
+        if (timer_is_before(t->sched_timer.waketime, end_time))
+            return;
+    }
+    tmcuart_start(t, write_len, write, read_len, 0, waketime);
+}
 DECL_COMMAND(command_tmcuart_send, "tmcuart_send oid=%c write=%*s read=%c");
 
+// Timer callback - note that a scheduled write is due
+static uint_fast8_t
+tmcuart_sched_event(struct timer *timer)
+{
+    struct tmcuart_s *t = container_of(timer, struct tmcuart_s, sched_timer);
+    t->flags |= TU_SEND_PENDING;
+    sched_wake_task(&tmcuart_wake);
+    return SF_DONE;
+}
+
+// Schedule a TMC UART write (without a response) at the given clock.
+// The write starts once the clock is reached and the uart is idle.
+void
+command_tmcuart_schedule_send(uint32_t *args)
+{
+    struct tmcuart_s *t = oid_lookup(args[0], command_config_tmcuart);
+    uint8_t write_len = args[2];
+    uint8_t *write = (void*)(size_t)args[3];
+    if (write_len > sizeof(t->sched_data))
+        shutdown("tmcuart scheduled send too large");
+    if (t->sched_len)
+        shutdown("tmcuart scheduled send already pending");
+    memcpy(t->sched_data, write, write_len);
+    t->sched_len = write_len;
+    t->sched_timer.func = tmcuart_sched_event;
+    irq_disable();
+    t->sched_timer.waketime = args[1];
+    sched_add_timer(&t->sched_timer);
+    irq_enable();
+}
+DECL_COMMAND(command_tmcuart_schedule_send,
+             "tmcuart_schedule_send oid=%c clock=%u write=%*s");
+
 // Report completed response message back to host
 void
 tmcuart_task(void)
@@ -226,13 +283,23 @@ tmcuart_task(void)
     uint8_t oid;
     struct tmcuart_s *t;
     foreach_oid(oid, t, command_config_tmcuart) {
-        if (!(t->flags & TU_REPORT))
+        if (t->flags & TU_REPORT) {
+            irq_disable();
+            t->flags &= ~TU_REPORT;
+            irq_enable();
+            sendf("tmcuart_response oid=%c read=%*s"
+                  , oid, t->read_count / 8, t->data);
+        }
+        // Start a scheduled write that is due once the uart is idle
+        if ((t->flags & (TU_SEND_PENDING | TU_ACTIVE)) != TU_SEND_PENDING)
             continue;
         irq_disable();
-        t->flags &= ~TU_REPORT;
+        t->flags &= ~TU_SEND_PENDING;
         irq_enable();
-        sendf("tmcuart_response oid=%c read=%*s"
-              , oid, t->read_count / 8, t->data);
+        uint8_t write_len = t->sched_len;
+        t->sched_len = 0;
+        tmcuart_start(t, write_len, t->sched_data, 0, TU_NO_REPORT
+                      , timer_read_time() + timer_from_us(50));
     }
 }
 DECL_TASK(tmcuart_task);
@@ -243,6 +310,8 @@ tmcuart_shutdown(void)
     uint8_t i;
     struct tmcuart_s *t;
     foreach_oid(i, t, command_config_tmcuart) {
+        t->flags &= ~TU_SEND_PENDING;
+        t->sched_len = 0;
         tmcuart_reset_line(t);
     }
 }
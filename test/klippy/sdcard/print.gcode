@@ -0,0 +1,22 @@
+; Small print used by the virtual_sdcard tests
+G90
+M82
+G92 E0
+G1 Z0.2 F600
+G1 X10 Y10 F6000
+G1 X30 Y10 E1.0 F1800
+G1 X30 Y30 E2.0
+G1 X10 Y30 E3.0
+G1 X10 Y10 E4.0
+G1 Z0.4 F600
+G1 X30 Y10 E5.0 F1800
+G1 X30 Y30 E6.0
+G1 X10 Y30 E7.0
+G1 X10 Y10 E8.0
+G1 Z0.6 F600
+G1 X30 Y10 E9.0 F1800
+G1 X30 Y30 E10.0
+G1 X10 Y30 E11.0
+G1 X10 Y10 E12.0
+G1 E11.0 F2400
+G1 Z5 F600